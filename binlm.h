@@ -0,0 +1,450 @@
+/*
+* Copyright 2010, Graham Neubig
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// A binary LM format that can be memory-mapped and queried without any
+//  parsing. The contexts are stored as a trie in breadth-first order, where
+//  the children of each context are contiguous and sorted by word, the
+//  same reversed order as the PyLM tree (the child of context c1..ck with
+//  word c(k+1) is c1..ck+1, where c1 is the previous word). Each context
+//  has a sorted array of the words with tables in it, with their
+//  probabilities, and its fallback weight. Probabilities and fallbacks are
+//  log10 values, by default quantized to 8 bits with one codebook per level
+//  and otherwise stored as floats. The unigrams are always stored as floats
+//  for every word id.
+
+#ifndef BINLM_H__
+#define BINLM_H__
+
+#include "pylm.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace pylm {
+
+class BinLm {
+
+public:
+
+    static const int kCodes = 256;
+
+    // the fixed-size start of the file, sections follow at the offsets
+    //  given here, each aligned to 8 bytes
+    struct Header {
+        char magic[8];
+        uint32_t endian; // kEndian when written on a machine of the same byte order
+        uint32_t version;
+        uint32_t order;
+        uint32_t numWords;
+        uint32_t numNodes;
+        uint32_t quantized; // 1 if the entry probabilities and fallbacks are codes
+        uint64_t numEntries;
+        uint64_t symbolBegins; // uint64 [numWords+1], offsets into symbolChars
+        uint64_t symbolChars; // char, null-terminated names
+        uint64_t sortedWords; // uint32 [numWords], ids sorted by name
+        uint64_t unigrams; // float [numWords]
+        uint64_t levelBegins; // uint32 [order+1], the first node of each level
+        uint64_t childBegins; // uint32 [numNodes+1]
+        uint64_t nodeWords; // uint32 [numNodes]
+        uint64_t nodeFallbacks; // uint8 codes or float [numNodes]
+        uint64_t entryBegins; // uint64 [numNodes+1]
+        uint64_t entryWords; // uint32 [numEntries]
+        uint64_t entryProbs; // uint8 codes or float [numEntries]
+        uint64_t probCodes; // float [order*kCodes], if quantized
+        uint64_t fallbackCodes; // float [order*kCodes], if quantized
+        uint64_t size;
+    };
+
+    BinLm() : data_(0), size_(0), header_(0) { }
+    BinLm(const string & fileName) : data_(0), size_(0), header_(0) {
+        load(fileName);
+    }
+    ~BinLm() {
+        unload();
+    }
+
+    // map a file written by write() into memory
+    void load(const string & fileName) {
+        unload();
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if(fd == -1)
+            throw runtime_error("Could not open binary LM "+fileName);
+        struct stat st;
+        if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Header)) {
+            close(fd);
+            throw runtime_error("Binary LM "+fileName+" is too short");
+        }
+        void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED)
+            throw runtime_error("Could not map binary LM "+fileName);
+        data_ = (const char*)data;
+        size_ = st.st_size;
+        header_ = (const Header*)data_;
+        if(memcmp(header_->magic, magic(), sizeof(header_->magic)) || header_->version != kVersion ||
+                header_->endian != kEndian || header_->size != size_) {
+            unload();
+            throw runtime_error("Binary LM "+fileName+" has the wrong format or byte order");
+        }
+        symbolBegins_ = section<uint64_t>(header_->symbolBegins);
+        symbolChars_ = section<char>(header_->symbolChars);
+        sortedWords_ = section<uint32_t>(header_->sortedWords);
+        unigrams_ = section<float>(header_->unigrams);
+        levelBegins_ = section<uint32_t>(header_->levelBegins);
+        childBegins_ = section<uint32_t>(header_->childBegins);
+        nodeWords_ = section<uint32_t>(header_->nodeWords);
+        nodeFallbacks_ = section<uint8_t>(header_->nodeFallbacks);
+        nodeFallbackLogs_ = section<float>(header_->nodeFallbacks);
+        entryBegins_ = section<uint64_t>(header_->entryBegins);
+        entryWords_ = section<uint32_t>(header_->entryWords);
+        entryProbs_ = section<uint8_t>(header_->entryProbs);
+        entryProbLogs_ = section<float>(header_->entryProbs);
+        probCodes_ = section<float>(header_->probCodes);
+        fallbackCodes_ = section<float>(header_->fallbackCodes);
+    }
+
+    void unload() {
+        if(data_)
+            munmap((void*)data_, size_);
+        data_ = 0; size_ = 0; header_ = 0;
+    }
+
+    int getN() const { return header_->order; }
+    unsigned getVocabSize() const { return header_->numWords; }
+    unsigned getContextCount() const { return header_->numNodes; }
+    bool isQuantized() const { return header_->quantized; }
+
+    // the name of a word id
+    const char* getWord(unsigned id) const {
+        return symbolChars_+symbolBegins_[id];
+    }
+
+    // the id of a word name, or -1 if it is not in the vocabulary
+    int findWord(const string & word) const {
+        const uint32_t *lo = sortedWords_, *hi = sortedWords_+header_->numWords;
+        while(lo < hi) {
+            const uint32_t* mid = lo+(hi-lo)/2;
+            if(strcmp(getWord(*mid), word.c_str()) < 0)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        return (lo != sortedWords_+header_->numWords && word == getWord(*lo)) ? (int)*lo : -1;
+    }
+
+    // the log10 probability of a word given its context, where context[0]
+    //  is the previous word and the sentence boundary is id 0
+    float getLogProb(unsigned word, const unsigned* context, int contextLen) const {
+        if(word >= header_->numWords)
+            throw runtime_error("Word id out of range in BinLm::getLogProb");
+        float prob = unigrams_[word];
+        uint32_t node = 0;
+        for(int lev = 1; lev < (int)header_->order && lev <= contextLen; lev++) {
+            node = findChild(node, context[lev-1]);
+            if(node == kNone)
+                break;
+            const uint32_t* words = entryWords_+entryBegins_[node];
+            const uint32_t* end = entryWords_+entryBegins_[node+1];
+            const uint32_t* it = lower_bound(words, end, (uint32_t)word);
+            if(it != end && *it == word)
+                prob = getEntryProb(it-entryWords_, lev);
+            else
+                prob += getFallback(node, lev);
+        }
+        return prob;
+    }
+
+    // the log10 probability of a sentence, which should end with the
+    //  sentence boundary like the samples do
+    float getSentenceLogProb(const unsigned* words, int len) const {
+        vector<unsigned> context(header_->order, 0);
+        float prob = 0;
+        for(int i = 0; i < len; i++) {
+            int contextLen = min(i+1, (int)header_->order-1);
+            for(int j = 0; j < contextLen; j++)
+                context[j] = (i-j-1 >= 0 ? words[i-j-1] : 0);
+            prob += getLogProb(words[i], &context[0], contextLen);
+        }
+        return prob;
+    }
+
+    // write an LM in binary format, where strs are the names of the word
+    //  ids (after their first character, as in the ARPA file) and bases are
+    //  the base probabilities of all numWords words. Unless quantized, the
+    //  scores are those of the LM up to float precision
+    template <class T>
+    static void write(const PyLM<T> & lm, const string* strs, const LMProb* bases,
+                        unsigned numWords, const string & fileName, bool quantized = true) {
+        const int order = lm.getN();
+        const vector<LMProb> & strens = lm.getStrengths(), & discs = lm.getDiscounts();
+        // number the contexts level by level, with the children of each
+        //  context contiguous and sorted by word
+        vector< vector<PyId> > levels(order);
+        for(unsigned i = 0; i < lm.size(); i++)
+            if(lm.getNode(i))
+                levels[lm.getNode(i)->getLevel()].push_back(i);
+        vector<uint32_t> newIds(lm.size(), 0);
+        vector<PyId> nodes;
+        vector<uint32_t> levelBegins(order+1, 0);
+        for(int lev = 0; lev < order; lev++) {
+            vector< pair< pair<uint32_t,T>, PyId > > keys;
+            for(unsigned j = 0; j < levels[lev].size(); j++) {
+                const PyNode<T>* node = lm.getNode(levels[lev][j]);
+                uint32_t parent = (lev ? newIds[node->getParentPos()] : 0);
+                keys.push_back(make_pair(make_pair(parent, lev ? node->getId() : 0), levels[lev][j]));
+            }
+            sort(keys.begin(), keys.end());
+            levelBegins[lev] = nodes.size();
+            for(unsigned j = 0; j < keys.size(); j++) {
+                newIds[keys[j].second] = nodes.size();
+                nodes.push_back(keys[j].second);
+            }
+        }
+        levelBegins[order] = nodes.size();
+        const uint32_t numNodes = nodes.size();
+        // find the probabilities of each level from the one above
+        vector< vector< pair<T,LMProb> > > probs(lm.size());
+        vector<uint32_t> childBegins(numNodes+1, numNodes), nodeWords(numNodes, 0);
+        vector<uint64_t> entryBegins(numNodes+1, 0);
+        vector<float> fallbacks(numNodes);
+        for(uint32_t i = numNodes; i > 0; i--) {
+            const PyNode<T>* node = lm.getNode(nodes[i-1]);
+            if(node->getParentPos() != -1)
+                childBegins[newIds[node->getParentPos()]] = i-1;
+        }
+        for(uint32_t i = numNodes; i > 0; i--)
+            childBegins[i-1] = min(childBegins[i-1], childBegins[i]);
+        for(uint32_t i = 0; i < numNodes; i++) {
+            const PyNode<T>* node = lm.getNode(nodes[i]);
+            const int lev = node->getLevel();
+            PyId parent = node->getParentPos();
+            node->getTableProbs(parent == -1 ? 0 : &probs[parent], bases, strens, discs, lev, probs[nodes[i]]);
+            nodeWords[i] = (lev ? node->getId() : 0);
+            fallbacks[i] = log10(node->getFallbackProb(strens[lev], discs[lev]));
+            entryBegins[i+1] = entryBegins[i] + (lev ? probs[nodes[i]].size() : 0);
+        }
+        const uint64_t numEntries = entryBegins[numNodes];
+        // the unigrams of all words, with or without tables
+        vector<float> unigrams(numWords);
+        for(unsigned w = 0; w < numWords; w++)
+            unigrams[w] = log10(lm.getNode(0)->getEmitProb(w, bases[w], strens, discs, 0));
+        // the log probabilities of the entries, which are quantized with
+        //  the fallbacks one level at a time
+        vector<uint32_t> entryWords(numEntries);
+        vector<float> entryLogs(numEntries);
+        for(uint32_t i = levelBegins[1]; i < numNodes; i++) {
+            const vector< pair<T,LMProb> > & nodeProbs = probs[nodes[i]];
+            for(unsigned j = 0; j < nodeProbs.size(); j++) {
+                entryWords[entryBegins[i]+j] = nodeProbs[j].first;
+                entryLogs[entryBegins[i]+j] = log10(nodeProbs[j].second);
+            }
+        }
+        vector<float> probCodes, fallbackCodes;
+        vector<uint8_t> entryProbs, nodeFallbacks;
+        if(quantized) {
+            probCodes.resize(order*kCodes, 0);
+            fallbackCodes.resize(order*kCodes, 0);
+            entryProbs.resize(numEntries);
+            nodeFallbacks.resize(numNodes);
+            for(int lev = 0; lev < order; lev++) {
+                uint64_t begin = entryBegins[levelBegins[lev]], end = entryBegins[levelBegins[lev+1]];
+                quantize(&entryLogs[0]+begin, end-begin, &probCodes[lev*kCodes], &entryProbs[0]+begin);
+                quantize(&fallbacks[0]+levelBegins[lev], levelBegins[lev+1]-levelBegins[lev],
+                            &fallbackCodes[lev*kCodes], &nodeFallbacks[0]+levelBegins[lev]);
+            }
+        } else {
+            // store the bytes of the floats in place of the codes
+            entryProbs.assign((const uint8_t*)&entryLogs[0], (const uint8_t*)&entryLogs[0]+numEntries*sizeof(float));
+            nodeFallbacks.assign((const uint8_t*)&fallbacks[0], (const uint8_t*)&fallbacks[0]+numNodes*sizeof(float));
+        }
+        // the names, and the ids sorted by name
+        vector<uint64_t> symbolBegins(numWords+1, 0);
+        string symbolChars;
+        for(unsigned w = 0; w < numWords; w++) {
+            symbolBegins[w] = symbolChars.size();
+            symbolChars.append(strs[w], 1, string::npos);
+            symbolChars += '\0';
+        }
+        symbolBegins[numWords] = symbolChars.size();
+        vector<uint32_t> sortedWords(numWords);
+        for(unsigned w = 0; w < numWords; w++)
+            sortedWords[w] = w;
+        sort(sortedWords.begin(), sortedWords.end(), NameLess(symbolChars.c_str(), &symbolBegins[0]));
+        // lay out and write the sections
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic(), sizeof(header.magic));
+        header.endian = kEndian;
+        header.version = kVersion;
+        header.quantized = quantized;
+        header.order = order;
+        header.numWords = numWords;
+        header.numNodes = numNodes;
+        header.numEntries = numEntries;
+        uint64_t pos = align(sizeof(Header));
+        header.symbolBegins = place(pos, symbolBegins);
+        header.symbolChars = pos; pos = align(pos+symbolChars.size());
+        header.sortedWords = place(pos, sortedWords);
+        header.unigrams = place(pos, unigrams);
+        header.levelBegins = place(pos, levelBegins);
+        header.childBegins = place(pos, childBegins);
+        header.nodeWords = place(pos, nodeWords);
+        header.nodeFallbacks = place(pos, nodeFallbacks);
+        header.entryBegins = place(pos, entryBegins);
+        header.entryWords = place(pos, entryWords);
+        header.entryProbs = place(pos, entryProbs);
+        header.probCodes = place(pos, probCodes);
+        header.fallbackCodes = place(pos, fallbackCodes);
+        header.size = pos;
+        ofstream out(fileName.c_str(), ios::out | ios::binary);
+        out.write((const char*)&header, sizeof(header));
+        pos = sizeof(header);
+        writeSection(out, pos, header.symbolBegins, &symbolBegins[0], symbolBegins.size());
+        writeSection(out, pos, header.symbolChars, symbolChars.data(), symbolChars.size());
+        writeSection(out, pos, header.sortedWords, &sortedWords[0], sortedWords.size());
+        writeSection(out, pos, header.unigrams, &unigrams[0], unigrams.size());
+        writeSection(out, pos, header.levelBegins, &levelBegins[0], levelBegins.size());
+        writeSection(out, pos, header.childBegins, &childBegins[0], childBegins.size());
+        writeSection(out, pos, header.nodeWords, &nodeWords[0], nodeWords.size());
+        writeSection(out, pos, header.nodeFallbacks, &nodeFallbacks[0], nodeFallbacks.size());
+        writeSection(out, pos, header.entryBegins, &entryBegins[0], entryBegins.size());
+        writeSection(out, pos, header.entryWords, &entryWords[0], entryWords.size());
+        writeSection(out, pos, header.entryProbs, &entryProbs[0], entryProbs.size());
+        writeSection(out, pos, header.probCodes, &probCodes[0], probCodes.size());
+        writeSection(out, pos, header.fallbackCodes, &fallbackCodes[0], fallbackCodes.size());
+        writeSection(out, pos, header.size, (const char*)0, 0);
+        if(!out)
+            throw runtime_error("Could not write binary LM to "+fileName);
+    }
+
+private:
+
+    static const uint32_t kNone = (uint32_t)-1;
+    static const uint32_t kVersion = 2;
+    static const uint32_t kEndian = 0x01020304;
+
+    const char* data_;
+    size_t size_;
+    const Header* header_;
+    const uint64_t* symbolBegins_;
+    const char* symbolChars_;
+    const uint32_t* sortedWords_;
+    const float* unigrams_;
+    const uint32_t* levelBegins_;
+    const uint32_t* childBegins_;
+    const uint32_t* nodeWords_;
+    const uint8_t* nodeFallbacks_;
+    const float* nodeFallbackLogs_;
+    const uint64_t* entryBegins_;
+    const uint32_t* entryWords_;
+    const uint8_t* entryProbs_;
+    const float* entryProbLogs_;
+    const float* probCodes_;
+    const float* fallbackCodes_;
+
+    static const char* magic() { return "PYLMBIN"; }
+
+    // not copyable, as it owns the mapping
+    BinLm(const BinLm &);
+    BinLm & operator=(const BinLm &);
+
+    template <class S>
+    const S* section(uint64_t offset) const {
+        if(offset > size_)
+            throw runtime_error("Binary LM section out of range");
+        return (const S*)(data_+offset);
+    }
+
+    float getEntryProb(uint64_t entry, int lev) const {
+        return header_->quantized ? probCodes_[lev*kCodes+entryProbs_[entry]] : entryProbLogs_[entry];
+    }
+    float getFallback(uint32_t node, int lev) const {
+        return header_->quantized ? fallbackCodes_[lev*kCodes+nodeFallbacks_[node]] : nodeFallbackLogs_[node];
+    }
+
+    // the child of a context with a word, or kNone
+    uint32_t findChild(uint32_t node, uint32_t word) const {
+        const uint32_t* begin = nodeWords_+childBegins_[node];
+        const uint32_t* end = nodeWords_+childBegins_[node+1];
+        const uint32_t* it = lower_bound(begin, end, word);
+        return (it != end && *it == word) ? (uint32_t)(it-nodeWords_) : kNone;
+    }
+
+    // quantize values into equal-population bins, each represented by the
+    //  mean of its values
+    static void quantize(const float* vals, uint64_t size, float* codes, uint8_t* out) {
+        if(size == 0)
+            return;
+        vector< pair<float,uint64_t> > sorted(size);
+        for(uint64_t i = 0; i < size; i++)
+            sorted[i] = make_pair(vals[i], i);
+        sort(sorted.begin(), sorted.end());
+        for(int c = 0; c < kCodes; c++) {
+            uint64_t begin = size*c/kCodes, end = size*(c+1)/kCodes;
+            if(begin == end) {
+                codes[c] = sorted[min(begin,size-1)].first;
+                continue;
+            }
+            double sum = 0;
+            for(uint64_t i = begin; i < end; i++) {
+                sum += sorted[i].first;
+                out[sorted[i].second] = c;
+            }
+            codes[c] = sum/(end-begin);
+        }
+    }
+
+    static uint64_t align(uint64_t pos) {
+        return (pos+7)/8*8;
+    }
+    template <class S>
+    static uint64_t place(uint64_t & pos, const vector<S> & vec) {
+        uint64_t ret = pos;
+        pos = align(pos+vec.size()*sizeof(S));
+        return ret;
+    }
+    template <class S>
+    static void writeSection(ofstream & out, uint64_t & pos, uint64_t offset, const S* data, uint64_t size) {
+        static const char zeros[8] = { 0 };
+        out.write(zeros, offset-pos);
+        if(size)
+            out.write((const char*)data, size*sizeof(S));
+        pos = offset+size*sizeof(S);
+    }
+
+    struct NameLess {
+        const char* chars;
+        const uint64_t* begins;
+        NameLess(const char* c, const uint64_t* b) : chars(c), begins(b) { }
+        bool operator()(uint32_t a, uint32_t b) const {
+            return strcmp(chars+begins[a], chars+begins[b]) < 0;
+        }
+    };
+
+};
+
+}
+
+#endif
@@ -21,14 +21,24 @@
 #include "pylm.h"
 #include "lexfst.h"
 #include "pylmfst.h"
+#include "binlm.h"
+#include "pylmavg.h"
 #include "weighted-mapper.h"
 #include "sampgen.h"
 #include <stdlib.h>
 #include <time.h>
 #include <unordered_map>
+#include <set>
+#include <memory>
+#include <chrono>
 #include <fst/compose.h>
 #include <fst/prune.h>
 #include <fst/arcsort.h>
+#include <fst/arc-map.h>
+#include <fst/shortest-path.h>
+#include <fst/project.h>
+#include <fst/rmepsilon.h>
+#include <fst/determinize.h>
 
 #define MAX_WORD_LEN 1e3
 
@@ -58,6 +68,7 @@ private:
     double amScale_; // how much to scale the acoustic model (0.2)
     unsigned knownN_; // the n-gram size of the known word LM (3)
     unsigned unkN_; // the n-gram size of the unk LM (3)
+    double lmMaxMem_; // the memory budget of the known word LM in MB (0, no limit)
 
     // input parameters
     const char* inputFileList_; // the list of files to be input
@@ -70,38 +81,114 @@ private:
     bool cacheInput_;
     vector< Fst<StdArc> * > inputFsts_; // the FSTs, if cached
     const char* symbolFile_; // a file containing the symbols
+    const char* decodeModel_; // a saved model to segment the input with, instead of training
+    int nBest_; // the number of segmentations to print for each sentence when decoding (1)
+    bool writeLattices_; // write the rescored word lattice of each sentence when decoding (false)
+    const char* heldOutFile_; // a text file of held-out sentences to score during training
+    unsigned heldOutRate_; // the number of iterations between held-out scorings (1)
+    vector< Fst<StdArc> * > heldOutFsts_; // the held-out sentences
+    unsigned heldOutLength_; // the number of held-out characters
+    const char* goldFile_; // the gold segmentation of the input, to evaluate the samples against
+    vector< vector<string> > goldWords_; // the words of each gold sentence
+    vector<string> goldStrings_; // the characters of each gold sentence, without separators
+    vector< vector<int> > goldBounds_; // the offsets of the word boundaries in goldStrings_
 
     // output parameters
     string prefix_; // the prefix of the output
     string separator_; // the character to use to separate the characters
+    bool exportFst_; // write the LMs as a static WFST with each sample (false)
+    float quantizeDelta_; // quantize the exported WFST weights (0, no quantization)
+    bool binLm_; // also write the LMs in binary format with each sample (false)
+    bool binLmExact_; // write the binary LMs without quantization (false)
+    bool avgLm_; // average the LMs of all samples and write them at the end (false)
+    bool boundPost_; // count the word boundaries of all samples and write them at the end (false)
+    bool sampFiles_; // write the segmentation of each sample (true)
+    bool binSamples_; // write the samples and symbols as binary streams of the changes (false)
+
+    // execution parameters
+    int numThreads_; // the number of threads to use where possible (1)
+    bool deltaUpdate_; // only update the changed n-grams of each sample (false)
+    int writeQueue_; // the number of samples that can wait to be written (1, 0 to write immediately)
 
     // training variables
     vector<unsigned> mySamples_; // which samples to use
     vector< vector<WordId> > histories_;
     unsigned unkSymbolSize_;
     double annealLevel_;
+    int numPruned_; // the number of contexts pruned from the known word LM
+    std::mt19937 paramRng_; // the generator of the parameter samples, seeded by -seed
 
     // data structure
     LexFst<WordId, CharId> * lexFst_;
     PyLM<WordId> * knownLm_;
     PyLM<CharId> * unkLm_;
     vector<LMProb> unkBases_;
+    vector<LMProb> wordBases_; // the spelling model probability of each word
+    vector<unsigned long> wordBaseVersions_; // the unkLm_ version of each wordBases_ entry
+
+    // the state needed to write a sample, copied so that it can be written
+    //  in the background while training continues
+    struct SampleSnapshot {
+        int iter;
+        PyLM<WordId> knownLm;
+        PyLM<CharId> unkLm;
+        vector<string> symbols;
+        vector< vector<CharId> > knownWords;
+        vector< vector<WordId> > histories;
+        SampleSnapshot(int it, const PyLM<WordId> & k, const PyLM<CharId> & u, const LexFst<WordId,CharId> & lex,
+                        const vector< vector<WordId> > & hists) : 
+            iter(it), knownLm(k), unkLm(u), symbols(lex.getSymbols()), knownWords(lex.getWords()),
+            histories(hists) { }
+    };
+    PyLMAverage knownAvg_, unkAvg_; // the averages of the sampled LMs, with avgLm_
+    vector< vector<int> > boundCounts_; // the samples with a boundary after each character, with boundPost_
+    std::unordered_map<string,int> wordCounts_; // the occurrences of each word in all samples, with boundPost_
+    int numBoundSamples_; // the number of samples counted in boundCounts_
+    std::unordered_map<string,uint32_t> streamIds_; // the ids of the words in the binary streams, with binSamples_
+    vector< vector<uint32_t> > streamHistories_; // the samples last written to the binary streams
+    bool streamsOpen_; // whether the binary streams have been started
+    BackgroundQueue writer_; // writes the samples
 
     // information variables
     double latticeLikelihood_; // the likelihood of the acoustic model
     double knownLikelihood_; // the likelihood of words generated by the LM
     double unkLikelihood_; // the likelihood of words generated by the unknown model
+    double heldOutLikelihood_; // the likelihood of the held-out sentences, if scored this iteration
+    bool heldOutScored_; // whether the held-out sentences were scored this iteration
+
+    // the agreement of the samples with the gold segmentation
+    struct SegScores {
+        long wordMatches, sampleWords, goldWords;
+        long boundMatches, sampleBounds, goldBounds;
+        long mismatched; // sentences whose characters differ from the gold
+        SegScores() : wordMatches(0), sampleWords(0), goldWords(0),
+            boundMatches(0), sampleBounds(0), goldBounds(0), mismatched(0) { }
+        SegScores & operator+=(const SegScores & o) {
+            wordMatches += o.wordMatches; sampleWords += o.sampleWords; goldWords += o.goldWords;
+            boundMatches += o.boundMatches; sampleBounds += o.sampleBounds; goldBounds += o.goldBounds;
+            mismatched += o.mismatched;
+            return *this;
+        }
+    };
+    SegScores goldScores_;
 
 
 public:
 
     LatticeLM() : numBurnIn_(20), numAnnealSteps_(5), annealStepLength_(3),
         numSamples_(100), sampleRate_(1), trimRate_(1),
-        pruneThreshold_(0), amScale_(0.2), knownN_(3), unkN_(3),
+        pruneThreshold_(0), amScale_(0.2), knownN_(3), unkN_(3), lmMaxMem_(0),
         inputFileList_(0), inputType_(INPUT_TEXT),
-        cacheInput_(false), symbolFile_(0),
-        prefix_(), separator_(), unkSymbolSize_(0), annealLevel_(0),
-        lexFst_(0), knownLm_(0), unkLm_(0), unkBases_()
+        cacheInput_(false), symbolFile_(0), decodeModel_(0), nBest_(1), writeLattices_(false),
+        heldOutFile_(0), heldOutRate_(1), heldOutFsts_(), heldOutLength_(0),
+        goldFile_(0), goldWords_(), goldStrings_(), goldBounds_(),
+        prefix_(), separator_(), exportFst_(false), quantizeDelta_(0), binLm_(false), binLmExact_(false), avgLm_(false),
+        boundPost_(false), sampFiles_(true), binSamples_(false),
+        numThreads_(1), deltaUpdate_(false), writeQueue_(1), unkSymbolSize_(0), annealLevel_(0), numPruned_(0), paramRng_(1),
+        lexFst_(0), knownLm_(0), unkLm_(0), unkBases_(), wordBases_(), wordBaseVersions_(), knownAvg_(), unkAvg_(),
+        boundCounts_(), wordCounts_(), numBoundSamples_(0),
+        streamIds_(), streamHistories_(), streamsOpen_(false), writer_(),
+        heldOutLikelihood_(0), heldOutScored_(false), goldScores_()
     {
 
     }
@@ -110,6 +197,8 @@ public:
         if(lexFst_)  delete lexFst_;
         if(knownLm_) delete knownLm_;
         if(unkLm_)   delete unkLm_;
+        for(unsigned i = 0; i < heldOutFsts_.size(); i++)
+            delete heldOutFsts_[i];
     }
 
     void dieOnHelp(const char* err) {
@@ -136,11 +225,62 @@ public:
 << "                 format, tropical semiring. Text files consist of one" << endl
 << "                 sentence per line." << endl
 << "  -symbolfile:   The symbol file for the WFSTs, not used for text input." << endl
+<< "  -decode:       Instead of training, print the most likely segmentation" << endl
+<< "                 of the input under a model saved by training (model)." << endl
+<< "  -nbest:        When decoding, print this many segmentations of each" << endl
+<< "                 sentence with their scores (1)." << endl
+<< "  -lattices:     When decoding, also write the word lattice of each" << endl
+<< "                 sentence rescored by the model (lattice.XX, sym)." << endl
+<< "  -heldout:      A text file of held-out sentences, whose likelihood and" << endl
+<< "                 perplexity are reported during training." << endl
+<< "  -heldoutrate:  The frequency (in iterations) at which to score the" << endl
+<< "                 held-out sentences (1)" << endl
+<< "  -gold:         The gold segmentation of the input, one sentence per" << endl
+<< "                 line. The word and boundary precision, recall and" << endl
+<< "                 F-measure of each iteration's sample are reported." << endl
 << "  -prefix:       The prefix under which to print all output." << endl
 << "  -separator:    The string to use to separate 'characters'." << endl
 << "  -cacheinput:   For WFST input, cache the WFSTs in memory (otherwise" << endl
 << "                 they will be loaded from disk every iteration)." << endl
-<< "  -seed:         The seed of the random value (0)" << endl;
+<< "  -seed:         The seed of the random value (0)" << endl
+<< "  -exportfst:    With each sample, also write the LMs as a single static" << endl
+<< "                 WFST in OpenFST const format (fst.XX)." << endl
+<< "  -quantize:     Quantize the weights of the exported WFST to multiples" << endl
+<< "                 of this value (0, no quantization)." << endl
+<< "  -binlm:        With each sample, also write the LMs in a binary format" << endl
+<< "                 that can be memory-mapped and queried with BinLm" << endl
+<< "                 (wlm.bin.XX, ulm.bin.XX)." << endl
+<< "  -binlmexact:   Store the probabilities of -binlm as floats instead of" << endl
+<< "                 quantizing them to 8 bits, so they match the LMs." << endl
+<< "  -avglm:        Average the LMs of all samples in memory, and write the" << endl
+<< "                 averages at the end of training (wlm.avg, ulm.avg). The" << endl
+<< "                 fallback weights and table terms of each context are" << endl
+<< "                 averaged separately, which keeps the backoff format but" << endl
+<< "                 only approximates the mean of the samples' probabilities." << endl
+<< "  -boundpost:    Count the word boundaries and words of all samples in" << endl
+<< "                 memory, and write them at the end of training (bound," << endl
+<< "                 wordcount)." << endl
+<< "  -nosampfiles:  Do not write the segmentation of each sample (samp.XX)." << endl
+<< "  -binsamples:   Write the samples and symbols as binary streams of the" << endl
+<< "                 sentences and words that changed in each sample" << endl
+<< "                 (samp.bin, sym.bin) instead of samp.XX and sym.XX." << endl
+<< "  -threads:      The number of threads to use where possible (1)" << endl
+<< "  -lmmaxmem:     The memory budget of the word LM in megabytes, checked" << endl
+<< "                 after every 1% of the sentences. When it is exceeded, the" << endl
+<< "                 leaf contexts with the fewest customers are merged into" << endl
+<< "                 their parents, which then stop growing new contexts until" << endl
+<< "                 the LM is a quarter below its budget. Any context but the" << endl
+<< "                 sentence start can be merged, so -knownn must be at least" << endl
+<< "                 2. The LM can exceed the budget by what 1% of the" << endl
+<< "                 sentences add (0, no limit)." << endl
+<< "  -deltaupdate:  Keep each sentence's previous sample in the LMs while" << endl
+<< "                 sampling it, and then only update the n-grams that" << endl
+<< "                 changed. This is faster but approximate, as the sentence" << endl
+<< "                 is sampled conditioned on its own previous sample." << endl
+<< "  -writequeue:   The number of samples that can wait to be written by a" << endl
+<< "                 background thread while training continues, each" << endl
+<< "                 holding a copy of the LMs (1, 0 to write each sample" << endl
+<< "                 before continuing)." << endl;
         if(err)
             cerr << endl << "Error: " << err << endl;
         exit(1);
@@ -149,13 +289,18 @@ public:
     CharId findId(const string & str, std::unordered_map<string,CharId> & idHash, vector<string> & idList) {
         std::unordered_map<string,CharId>::iterator it = idHash.find(str);
         if(it == idHash.end()) {
+            if(idHash.size() > (size_t)numeric_limits<CharId>::max())
+                THROW_ERROR("Too many symbols for the character id type, recompile with -DLATTICELM_WIDE_CHARS");
             idHash.insert(pair<string,CharId>(str,idHash.size()));
             idList.push_back("x"+str);
             return idHash.size()-1;
         }
         return it->second;
     }
-    vector<string> loadText() {
+    // load text files into FSTs. With the symbols of a saved model,
+    //  characters are given the ids of the model
+    vector<string> loadText(const vector<string> & files, vector< Fst<StdArc> * > & fsts, 
+                            const vector<string> * modelSymbols = 0) {
         std::unordered_map<string,CharId> idHash;
         vector<string> idList;
         int state;
@@ -166,8 +311,11 @@ public:
         findId("<phi>",idHash,idList);
         idList.push_back("x<unk>");
         idList.push_back("x</unk>");
-        for(unsigned i = 0; i < inputFiles_.size(); i++) {
-            ifstream in(inputFiles_[i].c_str());
+        if(modelSymbols)
+            for(unsigned i = 4; i+1 < modelSymbols->size(); i++)
+                idHash.insert(pair<string,CharId>((*modelSymbols)[i].substr(1),i-2));
+        for(unsigned i = 0; i < files.size(); i++) {
+            ifstream in(files[i].c_str());
             string line, str;
             while(getline(in,line)) {
                 istringstream iss(line);
@@ -175,17 +323,25 @@ public:
                 fst->AddState();
                 fst->SetStart(0);
                 for(state = 0; iss >> str; state++) {
-                    CharId lab = findId(str,idHash,idList);
+                    CharId lab;
+                    if(modelSymbols) {
+                        std::unordered_map<string,CharId>::const_iterator it = idHash.find(str);
+                        if(it == idHash.end())
+                            THROW_ERROR("Symbol '"<<str<<"' in "<<files[i]<<" is not in the model");
+                        lab = it->second;
+                    }
+                    else
+                        lab = findId(str,idHash,idList);
                     fst->AddState();
                     fst->AddArc(state,StdArc(lab,lab,0,state+1));
                 }
                 fst->SetFinal(state,0);
                 if(state == 0) {
-                    cerr << "Empty line found in "<<inputFiles_[i]<<endl;
+                    cerr << "Empty line found in "<<files[i]<<endl;
                     cerr << "Please ensure that each line in the training file contains at least one symbol."<<endl;
                     exit(1);
                 }
-                inputFsts_.push_back(fst);
+                fsts.push_back(fst);
             }
         }
         idList.push_back("w<s>");
@@ -205,6 +361,7 @@ public:
             else if(!strcmp(argv[argPos],"-samprate")) sampleRate_ = atoi(argv[++argPos]);
             else if(!strcmp(argv[argPos],"-knownn")) knownN_ = atoi(argv[++argPos]);
             else if(!strcmp(argv[argPos],"-unkn")) unkN_ = atoi(argv[++argPos]);
+            else if(!strcmp(argv[argPos],"-lmmaxmem")) lmMaxMem_ = atof(argv[++argPos]);
             else if(!strcmp(argv[argPos],"-prune")) pruneThreshold_ = atof(argv[++argPos]);
             else if(!strcmp(argv[argPos],"-filelist")) inputFileList_ = argv[++argPos];
             else if(!strcmp(argv[argPos],"-input")) {
@@ -217,14 +374,33 @@ public:
                 }
             }
             else if(!strcmp(argv[argPos],"-symbolfile")) symbolFile_ = argv[++argPos];
+            else if(!strcmp(argv[argPos],"-decode"))     decodeModel_ = argv[++argPos];
+            else if(!strcmp(argv[argPos],"-nbest"))      nBest_ = atoi(argv[++argPos]);
+            else if(!strcmp(argv[argPos],"-lattices"))   writeLattices_ = true;
+            else if(!strcmp(argv[argPos],"-heldout"))    heldOutFile_ = argv[++argPos];
+            else if(!strcmp(argv[argPos],"-heldoutrate")) heldOutRate_ = atoi(argv[++argPos]);
+            else if(!strcmp(argv[argPos],"-gold"))       goldFile_ = argv[++argPos];
             else if(!strcmp(argv[argPos],"-prefix"))     prefix_ = argv[++argPos];
             else if(!strcmp(argv[argPos],"-separator"))  separator_ = argv[++argPos];
             else if(!strcmp(argv[argPos],"-cacheinput")) cacheInput_ = true;
+            else if(!strcmp(argv[argPos],"-exportfst"))  exportFst_ = true;
+            else if(!strcmp(argv[argPos],"-quantize"))   quantizeDelta_ = atof(argv[++argPos]);
+            else if(!strcmp(argv[argPos],"-binlm"))      binLm_ = true;
+            else if(!strcmp(argv[argPos],"-binlmexact")) binLmExact_ = true;
+            else if(!strcmp(argv[argPos],"-avglm"))      avgLm_ = true;
+            else if(!strcmp(argv[argPos],"-boundpost"))  boundPost_ = true;
+            else if(!strcmp(argv[argPos],"-nosampfiles")) sampFiles_ = false;
+            else if(!strcmp(argv[argPos],"-binsamples"))  binSamples_ = true;
+            else if(!strcmp(argv[argPos],"-threads"))    numThreads_ = atoi(argv[++argPos]);
+            else if(!strcmp(argv[argPos],"-deltaupdate")) deltaUpdate_ = true;
+            else if(!strcmp(argv[argPos],"-writequeue"))  writeQueue_ = atoi(argv[++argPos]);
             else if(!strcmp(argv[argPos],"-seed")){
               int seed = atoi(argv[++argPos]);
               // seed(0)とseed(1)は同じ結果になってしまう．不都合なので種を変える
               if(seed == 0) seed = 32767;
-              srand(seed>=0 ? seed : (unsigned) time(NULL));
+              unsigned s = (seed>=0 ? seed : (unsigned) time(NULL));
+              srand(s);
+              paramRng_.seed(s);
             }
             else {
                 err << "Illegal option: " << argv[argPos];
@@ -232,6 +408,9 @@ public:
             }
         }
         if(inputType_ == INPUT_TEXT) cacheInput_ = true;
+        if(lmMaxMem_ > 0 && knownN_ < 2)
+            dieOnHelp("-lmmaxmem needs a known word LM with context (-knownn 2 or more)");
+        writer_.setMaxQueued(writeQueue_);
  
         // load the input files, either from the list or not
         if(inputFileList_) {
@@ -262,6 +441,24 @@ public:
                 checkFile.close();
             }
         }
+        // a saved model brings its own lexicon and LMs
+        if(decodeModel_) {
+            loadModel(decodeModel_);
+            if(inputType_ == INPUT_FST) {
+                inputFsts_.resize(inputFiles_.size(),0);
+                // the decoding threads read the input files themselves
+                cacheInput_ = false;
+            }
+            else {
+                const vector<string> symbols = lexFst_->getPermSymbols();
+                loadText(inputFiles_, inputFsts_, &symbols);
+            }
+            if(inputFiles_.size() == 0)
+                dieOnHelp("No input files specified");
+            else if(writeLattices_ && prefix_.length() == 0)
+                dieOnHelp("No output prefix was specified for the lattices");
+            return;
+        }
         lexFst_ = new LexFst<WordId,CharId>();
         lexFst_->setSeparator(separator_);
         // sanity check for the FST input
@@ -273,10 +470,14 @@ public:
         }
         // load the text input
         else { 
-            lexFst_->setPermSymbols(loadText());
+            lexFst_->setPermSymbols(loadText(inputFiles_, inputFsts_));
             lexFst_->initializeArcs();
         }
         histories_.resize(inputFsts_.size());
+        if(heldOutFile_)
+            loadHeldOut();
+        if(goldFile_)
+            loadGold();
 
         // load the symbols for the lexicon FST
         unkSymbolSize_ = lexFst_->getNumChars();
@@ -294,7 +495,61 @@ public:
             dieOnHelp("No input files specified");
         else if(prefix_.length() == 0)
             dieOnHelp("No output prefix was specified");
+        else if(heldOutRate_ == 0)
+            dieOnHelp("The held-out rate must be at least 1");
+
+    }
 
+    // load the gold segmentation, which has one line for every input sentence
+    void loadGold() {
+        ifstream in(goldFile_);
+        if(!in) {
+            ostringstream err; err << "Couldn't find gold file: " << goldFile_;
+            dieOnHelp(err.str().c_str());
+        }
+        string line, str;
+        while(getline(in,line)) {
+            istringstream iss(line);
+            vector<string> words;
+            string chars;
+            vector<int> bounds;
+            while(iss >> str) {
+                words.push_back(str);
+                // boundaries are compared on the characters alone
+                if(separator_.length())
+                    for(size_t pos; (pos = str.find(separator_)) != string::npos; )
+                        str.erase(pos, separator_.length());
+                if(chars.length())
+                    bounds.push_back(chars.length());
+                chars += str;
+            }
+            goldWords_.push_back(words);
+            goldStrings_.push_back(chars);
+            goldBounds_.push_back(bounds);
+        }
+        if(goldWords_.size() != inputFsts_.size()) {
+            ostringstream err; err << "The gold file " << goldFile_ << " has " << goldWords_.size() 
+                                   << " sentences, but the input has " << inputFsts_.size();
+            dieOnHelp(err.str().c_str());
+        }
+    }
+
+    // load the held-out sentences with the ids of the training symbols
+    void loadHeldOut() {
+        ifstream checkFile(heldOutFile_);
+        if(!checkFile) {
+            ostringstream err; err << "Couldn't find held-out file: " << heldOutFile_;
+            dieOnHelp(err.str().c_str());
+        }
+        const vector<string> symbols = lexFst_->getPermSymbols();
+        loadText(vector<string>(1, heldOutFile_), heldOutFsts_, &symbols);
+        // each character is predicted, but the sentence ends are not, as
+        //  the LMs give every final state weight one
+        heldOutLength_ = 0;
+        for(unsigned i = 0; i < heldOutFsts_.size(); i++)
+            for(StateIterator< Fst<StdArc> > si(*heldOutFsts_[i]); !si.Done(); si.Next())
+                heldOutLength_ += heldOutFsts_[i]->NumArcs(si.Value());
+        cerr << "Loaded " << heldOutFsts_.size() << " held-out sentences from " << heldOutFile_ << endl;
     }
 
     // train the model on all the data
@@ -321,6 +576,11 @@ public:
 
             // sample the model parameters and print status
             sampleParameters();
+            heldOutScored_ = heldOutFsts_.size() && iter%heldOutRate_ == 0;
+            if(heldOutScored_)
+                heldOutLikelihood_ = calcHeldOutLikelihood();
+            if(goldWords_.size())
+                goldScores_ = calcGoldScores();
             printIterationStatus(iter);
         
             // trim down the size if necessary
@@ -334,9 +594,177 @@ public:
             }
 
         }
+        writer_.finish();
+        if(avgLm_) {
+            writeAverage(unkAvg_,prefix_+"ulm.avg");
+            writeAverage(knownAvg_,prefix_+"wlm.avg");
+        }
+        if(boundPost_) {
+            writeBoundaries(prefix_+"bound");
+            writeWordCounts(prefix_+"wordcount");
+        }
+        saveModel(prefix_+"model");
 
     }
 
+    bool isDecoding() const { return decodeModel_ != 0; }
+
+    // print the most likely segmentations of each input sentence, decoding
+    //  the sentences in parallel without changing the model
+    void decode() {
+        const int numThreads = max(numThreads_, 1);
+        vector< vector< pair<double, vector<string> > > > results(inputFsts_.size());
+        const vector<string> symbols = lexFst_->getPermSymbols();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if(writeLattices_)
+            writeSymbols(lexFst_->getSymbols(),prefix_+"sym");
+        ParallelFor(numThreads, numThreads, [&](int t) {
+            // OpenFST does not count references atomically, so each thread
+            //  composes with its own copy of the lexicon, and its own LM
+            //  FST whose expanded states are kept for all its sentences
+            std::unique_ptr< LexFst<WordId,CharId> > lex(buildLexicon(symbols, lexFst_->getWords()));
+            PylmFst<WordId,CharId> pylmFst(*knownLm_, *unkLm_, unkSymbolSize_);
+            for(unsigned i = t; i < results.size(); i += numThreads)
+                results[i] = decodeSentence(i, *lex, pylmFst);
+        });
+        // a single segmentation is printed alone, n-best lists with the
+        //  sentence number and the negative log probability
+        for(unsigned i = 0; i < results.size(); i++) {
+            for(unsigned k = 0; k < results[i].size(); k++) {
+                if(nBest_ > 1)
+                    cout << i << "\t" << results[i][k].first << "\t";
+                const vector<string> & words = results[i][k].second;
+                for(unsigned j = 0; j < words.size(); j++) {
+                    if(j) cout << " ";
+                    cout << words[j];
+                }
+                cout << endl;
+            }
+        }
+        // the rate covers the decoding and printing, not loading the model
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        cerr << "Decoded "<<results.size()<<" sentences in "<<secs<<" seconds ("
+             <<results.size()/max(secs,1e-9)<<" sentences/second with "<<numThreads<<" threads)"<<endl;
+    }
+
+    // find the most likely segmentations of one sentence with their scores,
+    //  and write its rescored lattice if requested
+    vector< pair<double, vector<string> > > decodeSentence(unsigned sentId, const LexFst<WordId,CharId> & lex,
+                                                            const PylmFst<WordId,CharId> & pylmFst) {
+        Fst<StdArc> * inputFst = createInputFst(sentId);
+        // cached inputs are shared by the threads, so work on a copy
+        VectorFst<StdArc> input;
+        ArcMap(*inputFst, &input, IdentityArcMapper<StdArc>());
+        if(!cacheInput_)
+            delete inputFst;
+        ComposeFst<StdArc> ilFst(input, lex);
+        ComposeFstOptions<StdArc, PM> copts(CacheOptions(),
+                              new PM(ilFst, MATCH_NONE),
+                              new PM(pylmFst, MATCH_INPUT,1));
+        ComposeFst<StdArc> ilpFst(ilFst, pylmFst, copts);
+        // expand the search space if it is pruned, listed or written out
+        const bool wordLattice = (nBest_ > 1 || writeLattices_);
+        VectorFst<StdArc> latticeFst;
+        if(pruneThreshold_ != 0)
+            Prune<StdArc>(ilpFst,&latticeFst,pruneThreshold_);
+        else if(wordLattice)
+            latticeFst = VectorFst<StdArc>(ilpFst);
+        // many paths of the search space give the same words, so n-best
+        //  lists and lattices are found from the words alone, where each
+        //  sequence has a single path
+        VectorFst<StdArc> wordFst;
+        if(wordLattice) {
+            Project(&latticeFst, PROJECT_OUTPUT);
+            RmEpsilon(&latticeFst);
+            Determinize(latticeFst, &wordFst);
+        }
+        const Fst<StdArc> & searchFst = wordLattice ? (const Fst<StdArc> &)wordFst : 
+                                        (pruneThreshold_ != 0 ? (const Fst<StdArc> &)latticeFst : (const Fst<StdArc> &)ilpFst);
+        // an unknown word spelled like a known one has other labels but the
+        //  same name, so more paths are found until there are enough names
+        vector< pair<double, vector<string> > > ret;
+        for(int numPaths = max(nBest_,1); ; numPaths *= 2) {
+            VectorFst<StdArc> bestFst;
+            ShortestPath(searchFst,&bestFst,numPaths);
+            if(bestFst.Start() == kNoStateId)
+                THROW_ERROR("No segmentation was found for sentence "<<sentId);
+            vector< pair<double, vector<int> > > paths;
+            vector<int> labels;
+            findPaths(bestFst, bestFst.Start(), 0, labels, paths);
+            sort(paths.begin(), paths.end());
+            ret.clear();
+            set< vector<string> > seen;
+            for(unsigned i = 0; i < paths.size() && (int)ret.size() < max(nBest_,1); i++) {
+                vector<string> words = lex.parseWords(paths[i].second);
+                if(seen.insert(words).second)
+                    ret.push_back(make_pair(paths[i].first, words));
+            }
+            if((int)ret.size() >= nBest_ || (int)paths.size() < numPaths)
+                break;
+        }
+        if(writeLattices_) {
+            ostringstream oss; oss << prefix_ << "lattice." << sentId;
+            if(!wordFst.Write(oss.str()))
+                THROW_ERROR("Could not write lattice to "<<oss.str());
+        }
+        return ret;
+    }
+
+    // the log likelihood of the held-out sentences under the current
+    //  model, where each sentence is scored by its most likely
+    //  segmentation. The sentences are scored in parallel without
+    //  changing the model
+    double calcHeldOutLikelihood() const {
+        const int numThreads = max(numThreads_, 1);
+        vector<double> likelihoods(heldOutFsts_.size(), 0);
+        const vector<string> symbols = lexFst_->getPermSymbols();
+        ParallelFor(numThreads, numThreads, [&](int t) {
+            std::unique_ptr< LexFst<WordId,CharId> > lex(buildLexicon(symbols, lexFst_->getWords()));
+            PylmFst<WordId,CharId> pylmFst(*knownLm_, *unkLm_, unkSymbolSize_);
+            for(unsigned i = t; i < likelihoods.size(); i += numThreads)
+                likelihoods[i] = -scoreSentence(*heldOutFsts_[i], *lex, pylmFst);
+        });
+        double ret = 0;
+        for(unsigned i = 0; i < likelihoods.size(); i++)
+            ret += likelihoods[i];
+        return ret;
+    }
+
+    // the negative log probability of the most likely segmentation of a
+    //  sentence, which may be shared with other threads
+    double scoreSentence(const Fst<StdArc> & sentFst, const LexFst<WordId,CharId> & lex,
+                         const PylmFst<WordId,CharId> & pylmFst) const {
+        VectorFst<StdArc> input;
+        ArcMap(sentFst, &input, IdentityArcMapper<StdArc>());
+        ComposeFst<StdArc> ilFst(input, lex);
+        ComposeFstOptions<StdArc, PM> copts(CacheOptions(),
+                              new PM(ilFst, MATCH_NONE),
+                              new PM(pylmFst, MATCH_INPUT,1));
+        ComposeFst<StdArc> ilpFst(ilFst, pylmFst, copts);
+        VectorFst<StdArc> bestFst;
+        ShortestPath(ilpFst,&bestFst);
+        if(bestFst.Start() == kNoStateId)
+            THROW_ERROR("No segmentation was found for a held-out sentence");
+        vector< pair<double, vector<int> > > paths;
+        vector<int> labels;
+        findPaths(bestFst, bestFst.Start(), 0, labels, paths);
+        return paths[0].first;
+    }
+
+    // collect the non-epsilon output labels and costs of all the paths of
+    //  an acyclic FST
+    void findPaths(const Fst<StdArc> & fst, StdArc::StateId sid, double cost, vector<int> & labels, 
+                   vector< pair<double, vector<int> > > & paths) const {
+        if(fst.Final(sid) != StdArc::Weight::Zero())
+            paths.push_back(make_pair(cost+fst.Final(sid).Value(), labels));
+        for(ArcIterator< Fst<StdArc> > ai(fst, sid); !ai.Done(); ai.Next()) {
+            const StdArc & arc = ai.Value();
+            if(arc.olabel) labels.push_back(arc.olabel);
+            findPaths(fst, arc.nextstate, cost+arc.weight.Value(), labels, paths);
+            if(arc.olabel) labels.pop_back();
+        }
+    }
+
     // trim the models, removing unneeded vocabulary
     void trimModels() {
         // trim the language model
@@ -360,6 +788,9 @@ public:
                 histories_[i][j] = trimmedIds[histories_[i][j]];
         delete lexFst_;
         lexFst_ = nextLex;
+        // the word ids have changed
+        wordBases_.clear();
+        wordBaseVersions_.clear();
     }
 
     // print the status of the current iteration
@@ -368,32 +799,155 @@ public:
         out << "Finished iteration " << iter << " (Anneal="<<annealLevel_<<"), LM="<< (knownLikelihood_+unkLikelihood_) 
             << " (w=" << knownLikelihood_ << ", u="<<unkLikelihood_<<"), Lattice=" << latticeLikelihood_ << endl
              << " Vocabulary: w=" << knownLm_->getVocabSize() <<", u="<<unkLm_->getVocabSize() << endl
-             << " LM size: w=" << knownLm_->size() <<", u="<<unkLm_->size() << endl;
+             << " LM size: w=" << knownLm_->size() <<", u="<<unkLm_->size() << endl
+             << " LM memory: w=" << knownLm_->getMemoryBytes() << " bytes, u=" << unkLm_->getMemoryBytes() 
+             << " bytes, pruned contexts=" << numPruned_ << endl;
+        if(heldOutScored_)
+            out << " Held-out: LM=" << heldOutLikelihood_ << ", perplexity=" 
+                << exp(-heldOutLikelihood_/heldOutLength_) << " per character" << endl;
+        if(goldWords_.size()) {
+            const SegScores & g = goldScores_;
+            out << " Gold: words ";
+            printPrecRec(g.wordMatches, g.sampleWords, g.goldWords, out);
+            out << ", boundaries ";
+            printPrecRec(g.boundMatches, g.sampleBounds, g.goldBounds, out);
+            if(g.mismatched)
+                out << " (" << g.mismatched << " sentences differ from the gold characters)";
+            out << endl;
+        }
         for(int i = 0; i < knownLm_->getN(); i++)
             out << " WLM " << (i+1) << "-gram, s="<<knownLm_->getStrength(i)<<", d="<<knownLm_->getDiscount(i)<<endl;
         for(int i = 0; i < unkLm_->getN(); i++)
             out << " CLM " << (i+1) << "-gram, s="<<unkLm_->getStrength(i)<<", d="<<unkLm_->getDiscount(i)<<endl;
     }
     
+    // print the precision, recall and F-measure of matches in percent
+    static void printPrecRec(long matches, long tests, long refs, ostream & out) {
+        const double prec = tests ? 100.0*matches/tests : 0, rec = refs ? 100.0*matches/refs : 0;
+        out << "P=" << prec << "%, R=" << rec << "%, F=" << (prec+rec ? 2*prec*rec/(prec+rec) : 0) << "%";
+    }
+
+    // compare the current sample of every sentence with the gold
+    //  segmentation in parallel
+    SegScores calcGoldScores() const {
+        const int numThreads = max(numThreads_, 1);
+        vector<SegScores> scores(numThreads);
+        ParallelFor(numThreads, numThreads, [&](int t) {
+            for(unsigned i = t; i < histories_.size(); i += numThreads)
+                scores[t] += calcGoldScores(i);
+        });
+        SegScores ret;
+        for(int t = 0; t < numThreads; t++)
+            ret += scores[t];
+        return ret;
+    }
+
+    // compare the sample of one sentence with its gold segmentation. Words
+    //  are matched by the same alignment as grade.pl, and boundaries by
+    //  their character offsets when the characters are the same
+    SegScores calcGoldScores(unsigned sentId) const {
+        SegScores ret;
+        const vector<string> & symbols = lexFst_->getSymbols();
+        const vector< vector<CharId> > & spellings = lexFst_->getWords();
+        const unsigned wordOffset = lexFst_->getNumChars()+2;
+        const vector<WordId> & hist = histories_[sentId];
+        const vector<string> & gold = goldWords_[sentId];
+        vector<string> words(hist.size());
+        string chars;
+        vector<int> bounds;
+        for(unsigned i = 0; i < hist.size(); i++) {
+            words[i] = symbols[hist[i]+wordOffset].substr(1);
+            if(chars.length())
+                bounds.push_back(chars.length());
+            const vector<CharId> & spelling = spellings[hist[i]];
+            for(unsigned j = 0; j < spelling.size() && spelling[j] != 1; j++)
+                chars += symbols[spelling[j]+2].substr(1);
+        }
+        // the edit distance of grade.pl, where substitutions cost 1.1 and
+        //  deletions are preferred to insertions to matches on ties
+        const unsigned m = gold.size(), n = words.size();
+        vector< vector<double> > dist(m+1, vector<double>(n+1));
+        vector< vector<char> > ops(m+1, vector<char>(n+1));
+        for(unsigned i = 0; i <= m; i++) { dist[i][0] = i; ops[i][0] = 'd'; }
+        for(unsigned j = 1; j <= n; j++) { dist[0][j] = j; ops[0][j] = 'i'; }
+        for(unsigned i = 1; i <= m; i++) {
+            for(unsigned j = 1; j <= n; j++) {
+                const bool equal = (gold[i-1] == words[j-1]);
+                const double a = dist[i-1][j]+1, b = dist[i][j-1]+1, c = dist[i-1][j-1]+(equal?0:1.1);
+                if(a <= b && a <= c)  { dist[i][j] = a; ops[i][j] = 'd'; }
+                else if(b <= c)       { dist[i][j] = b; ops[i][j] = 'i'; }
+                else                  { dist[i][j] = c; ops[i][j] = (equal?'e':'s'); }
+            }
+        }
+        for(unsigned i = m, j = n; i > 0 || j > 0; ) {
+            const char op = ops[i][j];
+            if(op == 'e') ret.wordMatches++;
+            if(op != 'i') i--;
+            if(op != 'd') j--;
+        }
+        ret.sampleWords = n;
+        ret.goldWords = m;
+        // boundaries, which are sorted in both
+        if(chars != goldStrings_[sentId]) {
+            ret.mismatched = 1;
+            return ret;
+        }
+        const vector<int> & goldBounds = goldBounds_[sentId];
+        ret.sampleBounds = bounds.size();
+        ret.goldBounds = goldBounds.size();
+        for(unsigned i = 0, j = 0; i < bounds.size() && j < goldBounds.size(); ) {
+            if(bounds[i] == goldBounds[j]) { ret.boundMatches++; i++; j++; }
+            else if(bounds[i] < goldBounds[j]) i++;
+            else j++;
+        }
+        return ret;
+    }
+
     // sample the model parameters
     void sampleParameters() {
-        knownLm_->sampleParameters();
-        unkLm_->sampleParameters();
+        knownLm_->sampleParameters(paramRng_);
+        unkLm_->sampleParameters(paramRng_);
     }
 
-    // print a single sample to the appropriate file
+    // print a single sample to the appropriate file. The sample is copied
+    //  and written by the background writer, which waits while writeQueue_
+    //  samples are already waiting
     void printSample(int iter = -1) {
-        const vector<string> & symbols = lexFst_->getSymbols();
-        // const vector< vector<CharId> > & words = lexFst_->getWords();
-        writeLm(unkLm_,&symbols[2],&unkBases_[0],prefix_+"ulm",iter);
-        const vector< LMProb > wordBases = calculateWordBases();
-        writeLm(knownLm_,&symbols[2+unkSymbolSize_],&wordBases[0],prefix_+"wlm",iter);
-        writeSamples(&symbols[2+unkSymbolSize_],prefix_+"samp",iter);
-        // TODO print step fst
-        // TODO cumulate language models
-        // TODO print cumulated language model
+        std::shared_ptr<SampleSnapshot> snap(new SampleSnapshot(iter, *knownLm_, *unkLm_, *lexFst_, histories_));
+        writer_.push([this, snap]() { writeSample(*snap); });
+    }
+
+    // write all the files of a sample
+    void writeSample(SampleSnapshot & snap) {
+        const vector<string> & symbols = snap.symbols;
+        const int iter = snap.iter;
+        writeLm(&snap.unkLm,&symbols[2],&unkBases_[0],prefix_+"ulm",iter);
+        const vector< LMProb > wordBases = calculateWordBases(snap);
+        writeLm(&snap.knownLm,&symbols[2+unkSymbolSize_],&wordBases[0],prefix_+"wlm",iter);
+        if(binSamples_)
+            writeSampleStreams(snap.histories,&symbols[2+unkSymbolSize_],prefix_+"samp.bin",prefix_+"sym.bin",iter);
+        else if(sampFiles_)
+            writeSamples(snap.histories,&symbols[2+unkSymbolSize_],prefix_+"samp",iter);
+        if(boundPost_)
+            addBoundaries(snap.histories,snap.knownWords,&symbols[2+unkSymbolSize_]);
+        if(exportFst_)
+            writeFst(snap.knownLm,snap.unkLm,prefix_+"fst",iter);
+        // unkBases_ is indexed by position, so give every character its value
+        const vector<LMProb> charBases(unkSymbolSize_, 1.0/unkSymbolSize_);
+        if(binLm_) {
+            writeBinLm(&snap.unkLm,&symbols[2],&charBases[0],unkSymbolSize_,prefix_+"ulm.bin",iter);
+            writeBinLm(&snap.knownLm,&symbols[2+unkSymbolSize_],&wordBases[0],wordBases.size(),prefix_+"wlm.bin",iter);
+        }
+        // the samples are written in order, so the averages can be
+        //  accumulated here
+        if(avgLm_) {
+            unkAvg_.add(snap.unkLm,&symbols[2],&charBases[0],unkSymbolSize_);
+            knownAvg_.add(snap.knownLm,&symbols[2+unkSymbolSize_],&wordBases[0],wordBases.size());
+        }
         // TODO print cumulated fst
-        writeSymbols(prefix_+"sym",iter);
+        // the exported WFSTs are labeled with the ids of this sample
+        if(!binSamples_ || exportFst_)
+            writeSymbols(symbols,prefix_+"sym",iter);
     }
 
     void iterateSamples(double annealLevel) {
@@ -402,14 +956,26 @@ public:
         time_t start = time(NULL);
         for(unsigned i = 0; i < mySamples_.size(); i++) {
             singleSample(mySamples_[i], annealLevel);
-            if(i%step == step-1)
+            if(i%step == step-1) {
+                if(lmMaxMem_ > 0)
+                    limitLmMemory();
                 cerr << (i/step%10 == 9 ? '!' : '.');
+            }
         }
         cerr << ' ' << (time(NULL)-start) << " seconds" << endl;
     }
 
+    // prune the known word LM when it is over its memory budget, and let
+    //  it grow again once it is a quarter below it
+    void limitLmMemory() {
+        const size_t maxBytes = (size_t)(lmMaxMem_*1024*1024);
+        numPruned_ += knownLm_->prune(maxBytes, maxBytes/4*3);
+    }
+
     void singleSample(unsigned sentId, double annealLevel = 1) {
-        if(histories_[sentId].size())
+        // with delta updates the previous sample stays in the LMs
+        const bool replace = deltaUpdate_ && histories_[sentId].size();
+        if(histories_[sentId].size() && !replace)
             removeSample(sentId);
 
         // build
@@ -440,11 +1006,16 @@ public:
         VectorFst<StdArc> sampledFst;
         SampGen(prunedFst, sampledFst, 1, annealLevel);
         // save and add
+        vector<WordId> oldHistory;
+        oldHistory.swap(histories_[sentId]);
         histories_[sentId] = lexFst_->parseSample(sampledFst);
         // for(unsigned i = 0; i < histories_[sentId].size(); i++)
         //     cerr << histories_[sentId][i] << " ";
         //     cerr << endl;
-        addSample(sentId);
+        if(replace)
+            replaceSample(sentId, oldHistory);
+        else
+            addSample(sentId);
         if(!cacheInput_)
             delete inputFst;
         // calculate the likelihood
@@ -473,7 +1044,7 @@ public:
         // get the word base probabilities
         vector<LMProb> knownBases(words.size(),0);
         for(unsigned j = 0; j < words.size(); j++) 
-            knownBases[j] = exp(unkLm_->calcSentence(knownWords[words[j]], unkBases_, false));
+            knownBases[j] = getWordBase(words[j]);
         // sample the LM and save the probability
         knownLikelihood_ -= knownLm_->calcSentence(words, knownBases, true);
         const vector<int> & addPositions = knownLm_->getBasePositions();
@@ -481,6 +1052,26 @@ public:
             unkLikelihood_ -= unkLm_->calcSentence(knownWords[words[addPositions[j]]], unkBases_, true);
     }
 
+    // replace the previous sample of a sentence in the LMs with the new
+    //  one, only updating the customers whose n-grams changed. The removed
+    //  spellings are taken out of the spelling model before the new words'
+    //  base probabilities are found, as in removeSample and addSample
+    void replaceSample(unsigned sentId, const vector<WordId> & oldWords) {
+        const vector<WordId> & words = histories_[sentId];
+        const vector< vector<CharId> > & knownWords = lexFst_->getWords();
+        vector<bool> kept = knownLm_->removeChangedCustomers(oldWords, words);
+        const vector<int> & remPositions = knownLm_->getRemovedBasePositions();
+        for(unsigned j = 0; j < remPositions.size(); j++)
+            unkLm_->removeCustomers(knownWords[oldWords[remPositions[j]]]);
+        vector<LMProb> knownBases(words.size(),0);
+        for(unsigned j = 0; j < words.size(); j++) 
+            knownBases[j] = getWordBase(words[j]);
+        knownLikelihood_ -= knownLm_->addChangedCustomers(words, knownBases, kept);
+        const vector<int> & addPositions = knownLm_->getBasePositions();
+        for(unsigned j = 0; j < addPositions.size(); j++) 
+            unkLikelihood_ -= unkLm_->calcSentence(knownWords[words[addPositions[j]]], unkBases_, true);
+    }
+
     // create (or load) an FST representing the data
     Fst<StdArc> * createInputFst(unsigned sentId) {
         // cerr << "createInputFst("<<sentId<<") "<<cacheInput_<<", "<<inputFsts_.size()<<", "<<(int)inputFsts_[sentId]<<endl;
@@ -500,17 +1091,35 @@ public:
         return ret;
     }
 
-    // get the word base probabilities
-    vector<LMProb> calculateWordBases() {
-        const vector< vector<CharId> > & knownWords = lexFst_->getWords();
+    // get the base probability of a known word from the spelling model.
+    //  Any change to the spelling model can change the probability of
+    //  every word through the fallback of the root, so values are reused
+    //  only until the version of unkLm_ changes
+    LMProb getWordBase(WordId id) {
+        if(id >= (WordId)wordBases_.size()) {
+            wordBases_.resize(id+1, 0);
+            wordBaseVersions_.resize(id+1, (unsigned long)-1);
+        }
+        if(wordBaseVersions_[id] != unkLm_->getVersion()) {
+            wordBases_[id] = exp(unkLm_->calcSentence(lexFst_->getWords()[id], unkBases_, false));
+            wordBaseVersions_[id] = unkLm_->getVersion();
+        }
+        return wordBases_[id];
+    }
+
+    // get the word base probabilities of a sample. The values cached in
+    //  wordBases_ are not reused, as sampling the parameters changes the
+    //  spelling model's version before every sample is written
+    vector<LMProb> calculateWordBases(SampleSnapshot & snap) {
+        const vector< vector<CharId> > & knownWords = snap.knownWords;
         vector<LMProb> bases(knownWords.size(),0);
         for(unsigned j = 0; j < knownWords.size(); j++) 
-            bases[j] = exp(unkLm_->calcSentence(knownWords[j], unkBases_, false));
+            bases[j] = exp(snap.unkLm.calcSentence(knownWords[j], unkBases_, false));
         return bases;
     }
 
     // write out the symbol file
-    void writeSymbols(string fileName, int iter = -1) {
+    void writeSymbols(const vector<string> & words, string fileName, int iter = -1) const {
         if(!fileName.length())
             fileName = prefix_+"sym";
         if(iter >= 0) {
@@ -519,12 +1128,25 @@ public:
         }
         cerr << "  Writing symbols to "<<fileName<<endl;
         ofstream symOut(fileName.c_str());
-        const vector<string> & words = lexFst_->getSymbols();
         for(unsigned i = 0; i < words.size(); i++)
             symOut << words[i] << "\t" << i << endl;
         symOut.close();
     }
 
+    // write out both LMs as a single static WFST
+    void writeFst(const PyLM<WordId> & knownLm, const PyLM<CharId> & unkLm, string fileName, int iter = -1) {
+        if(!fileName.length())
+            fileName = prefix_+"fst";
+        if(iter >= 0) {
+            ostringstream oss; oss << fileName << '.' << iter; 
+            fileName = oss.str();
+        }
+        cerr << "  Writing FST to "<<fileName<<endl;
+        PylmFst<WordId,CharId> pylmFst(knownLm, unkLm, unkSymbolSize_);
+        if(!pylmFst.WriteConst(fileName, numThreads_, quantizeDelta_))
+            THROW_ERROR("Could not write FST to "<<fileName);
+    }
+
     // write out the LM file
     template <class T>
     void writeLm(const PyLM<T> * lm, const string* symbols, const LMProb* bases, string fileName, int iter = -1) {
@@ -536,12 +1158,209 @@ public:
         }
         cerr << "  Writing LM to "<<fileName<<endl;
         ofstream lmOut(fileName.c_str());
-        lm->print(symbols,bases,lmOut);
+        lm->print(symbols,bases,lmOut,numThreads_);
+        lmOut.close();
+    }
+
+    // write out the LM file in binary format
+    template <class T>
+    void writeBinLm(const PyLM<T> * lm, const string* symbols, const LMProb* bases, unsigned numWords, string fileName, int iter = -1) {
+        if(iter >= 0) {
+            ostringstream oss; oss << fileName << '.' << iter; 
+            fileName = oss.str();
+        }
+        cerr << "  Writing binary LM to "<<fileName<<endl;
+        BinLm::write(*lm,symbols,bases,numWords,fileName,!binLmExact_);
+    }
+
+    // count the boundaries after each character and the words of a sample
+    void addBoundaries(const vector< vector<WordId> > & histories, const vector< vector<CharId> > & knownWords, const string* symbols) {
+        if(boundCounts_.size() < histories.size())
+            boundCounts_.resize(histories.size());
+        for(unsigned i = 0; i < histories.size(); i++) {
+            unsigned pos = 0;
+            for(unsigned j = 0; j < histories[i].size(); j++) {
+                WordId id = histories[i][j];
+                if(id == 0) continue;
+                // spellings usually end with the end of word symbol
+                const vector<CharId> & word = knownWords[id];
+                pos += word.size() - (word.back() == 1 ? 1 : 0);
+                if(boundCounts_[i].size() < pos)
+                    boundCounts_[i].resize(pos, 0);
+                boundCounts_[i][pos-1]++;
+                wordCounts_[symbols[id].substr(1)]++;
+            }
+        }
+        numBoundSamples_++;
+    }
+
+    // write out the number of samples with a boundary after each character
+    //  of each sentence, one sentence per line, after the number of samples
+    void writeBoundaries(const string & fileName) {
+        cerr << "  Writing the boundaries of "<<numBoundSamples_<<" samples to "<<fileName<<endl;
+        ofstream boundOut(fileName.c_str());
+        boundOut << numBoundSamples_ << endl;
+        for(unsigned i = 0; i < boundCounts_.size(); i++) {
+            for(unsigned j = 0; j < boundCounts_[i].size(); j++) {
+                if(j) boundOut << " ";
+                boundOut << boundCounts_[i][j];
+            }
+            boundOut << endl;
+        }
+        boundOut.close();
+    }
+
+    // write out the words of all samples with their counts, most frequent first
+    void writeWordCounts(const string & fileName) {
+        cerr << "  Writing word counts to "<<fileName<<endl;
+        vector< pair<int,string> > counts;
+        for(std::unordered_map<string,int>::const_iterator it = wordCounts_.begin(); it != wordCounts_.end(); it++)
+            counts.push_back(make_pair(-it->second, it->first));
+        sort(counts.begin(), counts.end());
+        ofstream countOut(fileName.c_str());
+        for(unsigned i = 0; i < counts.size(); i++)
+            countOut << counts[i].second << "\t" << -counts[i].first << endl;
+        countOut.close();
+    }
+
+    // append the sentences that changed since the last sample to the
+    //  binary sample stream, and the words that were not seen before to the
+    //  symbol stream. The streams give each word a fixed id by name, so
+    //  trimming the lexicon does not change them
+    void writeSampleStreams(const vector< vector<WordId> > & histories, const string* symbols, 
+                            const string & sampName, const string & symName, int iter) {
+        cerr << "  Writing changed samples to "<<sampName<<endl;
+        ios::openmode mode = ios::out | ios::binary | (streamsOpen_ ? ios::app : ios::trunc);
+        ofstream sampOut(sampName.c_str(), mode), symOut(symName.c_str(), mode);
+        if(!streamsOpen_) {
+            sampOut.write("SAMPBIN", 8);
+            symOut.write("SYMBBIN", 8);
+            streamsOpen_ = true;
+        }
+        vector<string> newWords;
+        vector<uint32_t> changed, offsets(1, 0), words;
+        streamHistories_.resize(histories.size());
+        for(unsigned i = 0; i < histories.size(); i++) {
+            vector<uint32_t> ids(histories[i].size());
+            for(unsigned j = 0; j < ids.size(); j++) {
+                std::pair<std::unordered_map<string,uint32_t>::iterator,bool> p = 
+                    streamIds_.insert(make_pair(symbols[histories[i][j]], (uint32_t)streamIds_.size()));
+                if(p.second)
+                    newWords.push_back(symbols[histories[i][j]].substr(1));
+                ids[j] = p.first->second;
+            }
+            if(ids == streamHistories_[i])
+                continue;
+            changed.push_back(i);
+            words.insert(words.end(), ids.begin(), ids.end());
+            offsets.push_back(words.size());
+            streamHistories_[i].swap(ids);
+        }
+        // iteration, sentence count, changed count, ids, offsets, words
+        int32_t it = iter;
+        uint32_t sizes[2] = { (uint32_t)histories.size(), (uint32_t)changed.size() };
+        sampOut.write((const char*)&it, sizeof(it));
+        sampOut.write((const char*)sizes, sizeof(sizes));
+        sampOut.write((const char*)changed.data(), changed.size()*sizeof(uint32_t));
+        sampOut.write((const char*)&offsets[0], offsets.size()*sizeof(uint32_t));
+        sampOut.write((const char*)words.data(), words.size()*sizeof(uint32_t));
+        // iteration, new word count, null-terminated names
+        uint32_t numNew = newWords.size();
+        symOut.write((const char*)&it, sizeof(it));
+        symOut.write((const char*)&numNew, sizeof(numNew));
+        for(unsigned i = 0; i < newWords.size(); i++)
+            symOut.write(newWords[i].c_str(), newWords[i].size()+1);
+        if(!sampOut || !symOut)
+            THROW_ERROR("Could not write the sample streams "<<sampName<<" and "<<symName);
+        cerr << "   "<<changed.size()<<" changed sentences, "<<numNew<<" new words"<<endl;
+    }
+
+    // build a lexicon from its permanent symbols and the spellings of its
+    //  words, which keep their ids
+    LexFst<WordId,CharId> * buildLexicon(const vector<string> & symbols, const vector< vector<CharId> > & words) const {
+        LexFst<WordId,CharId> * lex = new LexFst<WordId,CharId>;
+        lex->setSeparator(separator_);
+        lex->setPermSymbols(symbols);
+        lex->initializeArcs();
+        for(unsigned i = 1; i < words.size(); i++) {
+            if(lex->addWord(words[i]) != (WordId)i) {
+                delete lex;
+                THROW_ERROR("Duplicate word "<<i<<" in the lexicon");
+            }
+        }
+        return lex;
+    }
+
+    // save the lexicon and both LMs, which -decode can load
+    void saveModel(const string & fileName) {
+        cerr << "  Writing model to "<<fileName<<endl;
+        ofstream out(fileName.c_str(), ios::out | ios::binary);
+        out.write("LTLMMODL", 8);
+        WriteBinary(out, (int32_t)2);
+        WriteBinary(out, vector<char>(separator_.begin(), separator_.end()));
+        const vector<string> symbols = lexFst_->getPermSymbols();
+        WriteBinary(out, (uint32_t)symbols.size());
+        for(unsigned i = 0; i < symbols.size(); i++)
+            WriteBinary(out, vector<char>(symbols[i].begin(), symbols[i].end()));
+        const vector< vector<CharId> > & words = lexFst_->getWords();
+        WriteBinary(out, (uint32_t)words.size());
+        for(unsigned i = 0; i < words.size(); i++)
+            WriteBinary(out, vector<int32_t>(words[i].begin(), words[i].end()));
+        knownLm_->write(out);
+        unkLm_->write(out);
+        if(!out)
+            THROW_ERROR("Could not write model to "<<fileName);
+    }
+
+    // load a model written by saveModel
+    void loadModel(const string & fileName) {
+        ifstream in(fileName.c_str(), ios::in | ios::binary);
+        char magic[8];
+        int32_t version;
+        if(!in.read(magic, 8) || memcmp(magic, "LTLMMODL", 8))
+            THROW_ERROR("Could not read model from "<<fileName);
+        ReadBinary(in, version);
+        if(version != 2)
+            THROW_ERROR("Unknown model version "<<version<<" in "<<fileName);
+        vector<char> chars;
+        ReadBinary(in, chars);
+        separator_.assign(chars.begin(), chars.end());
+        uint32_t size;
+        ReadBinary(in, size);
+        vector<string> symbols(size);
+        for(unsigned i = 0; i < size; i++) {
+            ReadBinary(in, chars);
+            symbols[i].assign(chars.begin(), chars.end());
+        }
+        ReadBinary(in, size);
+        vector< vector<CharId> > words(size);
+        vector<int32_t> spelling;
+        for(unsigned i = 0; i < size; i++) {
+            ReadBinary(in, spelling);
+            words[i].assign(spelling.begin(), spelling.end());
+        }
+        lexFst_ = buildLexicon(symbols, words);
+        knownLm_ = PyLM<WordId>::read(in);
+        unkLm_ = PyLM<CharId>::read(in);
+        knownN_ = knownLm_->getN();
+        unkN_ = unkLm_->getN();
+        unkSymbolSize_ = lexFst_->getNumChars();
+        unkBases_.resize(MAX_WORD_LEN,1.0/unkSymbolSize_);
+        cerr << "Loaded model from "<<fileName<<" with "<<words.size()<<" words and "<<unkSymbolSize_<<" symbols"<<endl;
+    }
+
+    // write out an averaged LM
+    void writeAverage(const PyLMAverage & avg, const string & fileName) {
+        if(avg.getSampleCount() == 0)
+            return;
+        cerr << "  Writing the average of "<<avg.getSampleCount()<<" LMs to "<<fileName<<endl;
+        ofstream lmOut(fileName.c_str());
+        avg.print(lmOut);
         lmOut.close();
     }
 
     // write out the samples
-    void writeSamples(const string* symbols, string fileName, int iter = -1) {
+    void writeSamples(const vector< vector<WordId> > & histories, const string* symbols, string fileName, int iter = -1) {
         if(!fileName.length())
             fileName = prefix_+"samp";
         if(iter >= 0) {
@@ -550,10 +1369,10 @@ public:
         }
         cerr << "  Writing samples to "<<fileName<<endl;
         ofstream sampOut(fileName.c_str());
-        for(unsigned i = 0; i < histories_.size(); i++) {
-            for(unsigned j = 0; j < histories_[i].size(); j++) {
+        for(unsigned i = 0; i < histories.size(); i++) {
+            for(unsigned j = 0; j < histories[i].size(); j++) {
                 if(j) sampOut << " ";
-                sampOut << symbols[histories_[i][j]].substr(1);
+                sampOut << symbols[histories[i][j]].substr(1);
             }
             sampOut << endl;
         }
@@ -19,6 +19,7 @@
 
 #include "util.h"
 #include <stdexcept>
+#include <limits>
 #include <fst/vector-fst.h>
 
 using namespace fst;
@@ -76,6 +77,8 @@ public:
         }
         while(in >> buff) {
             // cerr << "Adding symbol " << buff << " as " << numChars_ << endl;
+            if(numChars_ == numeric_limits<CharId>::max())
+                THROW_ERROR("Too many symbols for the character id type, recompile with -DLATTICELM_WIDE_CHARS");
             numChars_++;
             symbols_.push_back("x"+buff);
             in >> buff;
@@ -135,7 +138,34 @@ public:
         return ret;
     }
 
-    
+    // the names of the words given by the output labels of a path, without
+    //  adding unknown words to the lexicon so that it can be used by
+    //  several threads at once
+    vector<string> parseWords(const vector<int> & labels) const {
+        vector<string> ret;
+        string unk;
+        for(unsigned i = 0; i < labels.size(); i++) {
+            const int label = labels[i];
+            // known words other than the sentence boundary
+            if(label >= (int)numChars_+2) {
+                if(label > (int)numChars_+2)
+                    ret.push_back(symbols_[label].substr(1));
+            }
+            // the end of an unknown word
+            else if(label == 3) {
+                ret.push_back(unk);
+                unk.clear();
+            }
+            else if(label > 3) {
+                if(unk.length()) unk += separator_;
+                unk += symbols_[label].substr(1);
+            }
+        }
+        if(unk.length())
+            ret.push_back(unk);
+        return ret;
+    }
+
     WordId addWord(const vector<CharId> & word) {
         if(word.size() == 0)
             return 0;
@@ -165,7 +195,9 @@ public:
         if(!aiter.Done())
             return aiter.Value().olabel - numChars_ - 2;
         // otherwise, add the word to the dictionary
-        WordId newId = words_.size()+numChars_+2;
+        if(words_.size() > (size_t)numeric_limits<WordId>::max())
+            THROW_ERROR("Too many words for the word id type, recompile without -DLATTICELM_NARROW_WORDS");
+        int newId = words_.size()+numChars_+2;
         AddArc(sid, StdArc(0,newId,0,homeState_));
         words_.push_back(word);
         // add the symbol
@@ -177,8 +209,8 @@ public:
         return words_.size()-1;
     }
 
-    const vector< vector<CharId> > & getWords() { return words_; }
-    const vector< string > & getSymbols() { return symbols_; }
+    const vector< vector<CharId> > & getWords() const { return words_; }
+    const vector< string > & getSymbols() const { return symbols_; }
     // get symbols that cannot be trimmed (character symbols + start/end symbols)
     vector< string > getPermSymbols() { 
         vector< string > ret(symbols_);
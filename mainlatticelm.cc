@@ -22,5 +22,8 @@ using namespace latticelm;
 int main(int argc, char** argv) {
     LatticeLM latticeLm;
     latticeLm.loadProperties(argc,argv);
-    latticeLm.train();
+    if(latticeLm.isDecoding())
+        latticeLm.decode();
+    else
+        latticeLm.train();
 }
@@ -35,11 +35,16 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <algorithm>
+#include <limits>
+#include <random>
 #include <stdexcept>
 #include <cstdlib>
 #include <cmath>
 #include <sstream>
 #include <iostream>
+#include <cstdio>
+#include "util.h"
 
 #define PRIOR_DA 1.5
 #define PRIOR_DB 1.5
@@ -52,9 +57,229 @@ using namespace std;
 
 namespace pylm {
 
+// probabilities are doubles unless single precision is requested
+#ifdef LATTICELM_FLOAT_PROB
+typedef float LMProb;
+#else
 typedef double LMProb;
+#endif
 typedef int PyId;
 typedef std::unordered_map<int, int> CountMap;
+
+// add one to a bucket of a histogram
+inline void addCount(CountMap & map, int place) {
+    pair<CountMap::iterator,bool> p = map.insert(pair<int,int>(place,0));
+    p.first->second++;
+}
+
+// remove one from a bucket of a histogram, erasing empty buckets
+inline void removeCount(CountMap & map, int place) {
+    CountMap::iterator it = map.find(place);
+    if(it == map.end())
+        throw runtime_error("Attempt to remove a non-existent count");
+    if(--it->second == 0)
+        map.erase(it);
+}
+
+// The histograms of the seating arrangements of all nodes at one level of
+// the tree, which are used to sample the hyperparameters of the level.
+// These are kept up to date as customers are added and removed. Like the
+// auxiliary variable sampler, they only count nodes with more than one
+// table and tables with more than one customer.
+class PyLevelCounts {
+
+public:
+    CountMap nodeCustCounts, nodeTableCounts, tableCustCounts;
+    PyLevelCounts() : nodeCustCounts(), nodeTableCounts(), tableCustCounts() { }
+
+};
+    
+// An open-addressing hash from (node, word) pairs to nodes, which is
+// shared by all the nodes of a tree so that a node with few children does
+// not need a table of its own. Collisions are resolved by linear probing,
+// and erased entries are filled by shifting later entries back
+template <class T>
+class PyNodeHash {
+
+    struct Entry {
+        PyId key;
+        T word;
+        PyId value;
+    };
+
+    vector<Entry> table_;
+    size_t size_;
+
+    size_t slot(PyId key, T word) const {
+        unsigned long long h = ((unsigned long long)(unsigned)key << 32) | (unsigned)word;
+        h *= 0x9E3779B97F4A7C15ULL;
+        return (size_t)(h >> 32) & (table_.size()-1);
+    }
+
+    void grow() {
+        vector<Entry> old;
+        old.swap(table_);
+        Entry empty = { -1, T(), -1 };
+        table_.resize(old.size()*2, empty);
+        for(unsigned i = 0; i < old.size(); i++) {
+            if(old[i].key == -1) continue;
+            size_t j = slot(old[i].key, old[i].word);
+            while(table_[j].key != -1)
+                j = (j+1) & (table_.size()-1);
+            table_[j] = old[i];
+        }
+    }
+
+public:
+
+    PyNodeHash() : table_(), size_(0) { clear(); }
+
+    PyId find(PyId key, T word) const {
+        for(size_t i = slot(key, word); table_[i].key != -1; i = (i+1) & (table_.size()-1))
+            if(table_[i].key == key && table_[i].word == word)
+                return table_[i].value;
+        return -1;
+    }
+
+    void set(PyId key, T word, PyId value) {
+        if((size_+1)*2 > table_.size())
+            grow();
+        size_t i = slot(key, word);
+        for(; table_[i].key != -1; i = (i+1) & (table_.size()-1)) {
+            if(table_[i].key == key && table_[i].word == word) {
+                table_[i].value = value;
+                return;
+            }
+        }
+        table_[i].key = key;
+        table_[i].word = word;
+        table_[i].value = value;
+        size_++;
+    }
+
+    void erase(PyId key, T word) {
+        const size_t mask = table_.size()-1;
+        size_t i = slot(key, word);
+        for(; table_[i].key != -1; i = (i+1) & mask)
+            if(table_[i].key == key && table_[i].word == word)
+                break;
+        if(table_[i].key == -1)
+            return;
+        // move back any entries that probed past the erased one
+        for(size_t j = (i+1) & mask; table_[j].key != -1; j = (j+1) & mask) {
+            size_t k = slot(table_[j].key, table_[j].word);
+            if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            table_[i] = table_[j];
+            i = j;
+        }
+        table_[i].key = -1;
+        size_--;
+    }
+
+    void clear() {
+        Entry empty = { -1, T(), -1 };
+        table_.assign(16, empty);
+        size_ = 0;
+    }
+
+    size_t size() const { return size_; }
+    size_t getBytes() const { return table_.size()*sizeof(Entry); }
+
+};
+
+template <class T> class PyNode;
+
+// The nodes of a tree, with the scalar fields of every node kept in
+// parallel arrays indexed by PyId rather than in the nodes themselves, so
+// that passes over the whole model are linear scans. The arrays keep an
+// entry for deleted nodes, whose pointer in nodes is null, until the next
+// trim compacts them
+template <class T>
+class PyTree {
+
+public:
+    vector< PyNode<T>* > nodes;
+    vector<PyId> parents;
+    vector<T> ids;
+    vector<int> levels, tableCounts, custCounts, typeCounts, childCounts;
+    // contexts that had a child pruned, which cannot have children added
+    //  until the model is back under its memory budget
+    vector<bool> frozen;
+    vector< PyLevelCounts > counts;
+    PyNodeHash<T> children, links;
+    // the customers seated in a context in place of one of its children,
+    //  because the child was pruned or the context was frozen, by context,
+    //  child word and word. They are removed from the context rather than
+    //  from a child that has grown again since
+    typedef map< pair<PyId, pair<T,T> >, int > OrphanMap;
+    OrphanMap orphans;
+
+    PyTree(int n) : nodes(), parents(), ids(), levels(), tableCounts(), custCounts(), 
+                    typeCounts(), childCounts(), frozen(), counts(n), children(), links(), orphans() { }
+
+    // add the entries of a new node and return its id
+    PyId add(T id, PyId parent) {
+        PyId ret = nodes.size();
+        nodes.push_back(0);
+        parents.push_back(parent);
+        ids.push_back(id);
+        levels.push_back(parent == -1 ? 0 : levels[parent]+1);
+        tableCounts.push_back(0);
+        custCounts.push_back(0);
+        typeCounts.push_back(0);
+        childCounts.push_back(0);
+        frozen.push_back(false);
+        return ret;
+    }
+
+    // move the entries of each live node i to nodeIds[i]
+    void compact(const vector<PyId> & nodeIds) {
+        for(unsigned i = 0; i < nodes.size(); i++) {
+            PyId j = nodeIds[i];
+            if(j == -1) continue;
+            nodes[j] = nodes[i];
+            parents[j] = (parents[i]==-1?-1:nodeIds[parents[i]]);
+            ids[j] = ids[i];
+            levels[j] = levels[i];
+            tableCounts[j] = tableCounts[i];
+            custCounts[j] = custCounts[i];
+            typeCounts[j] = typeCounts[i];
+            childCounts[j] = childCounts[i];
+            frozen[j] = frozen[i];
+        }
+        unsigned size = 0;
+        for(unsigned i = 0; i < nodeIds.size(); i++)
+            if(nodeIds[i] != -1) size++;
+        nodes.resize(size);
+        parents.resize(size);
+        ids.resize(size);
+        levels.resize(size);
+        tableCounts.resize(size);
+        custCounts.resize(size);
+        typeCounts.resize(size);
+        childCounts.resize(size);
+        frozen.resize(size);
+    }
+
+    unsigned size() const { return nodes.size(); }
+    int getMaxLevel() const { return counts.size()-1; }
+
+    void addOrphans(PyId node, T child, T emit, int num) {
+        orphans[make_pair(node, make_pair(child, emit))] += num;
+    }
+
+    // remove one orphan of emit from node if it has one for child
+    bool removeOrphan(PyId node, T child, T emit) {
+        typename OrphanMap::iterator it = orphans.find(make_pair(node, make_pair(child, emit)));
+        if(it == orphans.end())
+            return false;
+        if(--it->second == 0)
+            orphans.erase(it);
+        return true;
+    }
+
+};
     
 template <class T>
 class PyNode {
@@ -62,119 +287,153 @@ class PyNode {
 public:
 
     typedef map< T, vector<int> > TableMap;
-    typedef std::unordered_map< T, PyId > NodeMap;
 
 protected:
 
-    vector< PyNode* > & nodes_;
+    PyTree<T> & tree_;
     PyId pos_;
 
-    T id_;
-
     TableMap tables_;
-    NodeMap children_;
-    PyId parent_;
 
-    int tableCount_, custCount_;
+    // the context whose successor link leads here. The links themselves
+    //  are kept in the shared hash, indexed by the source context and the
+    //  first word of this context
+    PyId suffix_;
 
 public:
 
 
-    PyNode(vector< PyNode* > & nodes, PyId pos = 0, T id = -1, PyId parent = -1) 
-        : nodes_(nodes), pos_(pos), id_(id), tables_(), children_(), parent_(parent), tableCount_(0), custCount_(0)  { }
+    PyNode(PyTree<T> & tree, PyId pos = 0) 
+        : tree_(tree), pos_(pos), tables_(), suffix_(-1) { }
 
-    ~PyNode() { }
+    // a copy of a node in a copy of its tree
+    PyNode(PyTree<T> & tree, const PyNode<T> & other) 
+        : tree_(tree), pos_(other.pos_), tables_(other.tables_), suffix_(other.suffix_) { }
 
-    void accumulateCounts(vector<unsigned> & counts, int lev) {
-        for(typename NodeMap::const_iterator it = children_.begin(); it != children_.end(); it++)
-            nodes_[it->second]->accumulateCounts(counts,lev+1);
-        counts[lev] += tables_.size();
-    }
+    ~PyNode() { }
 
-    void print(int lev, int max, const string* strs, const LMProb* bases, 
-                const vector<LMProb> & strens, const vector<LMProb> & discs, 
-                ostream & os = cout) const {
-        if(lev != max) {
-            for(typename NodeMap::const_iterator it = children_.begin(); it != children_.end(); it++)
-                nodes_[it->second]->print(lev+1, max, strs, bases, strens, discs, os);
-            return;
-        }
-        ostringstream buff;
-        LMProb log10 = log(10);
-        vector<PyId> path;
-        if(parent_ != -1) {
-            buff << strs[id_].substr(1);
-            path.push_back(id_);
-            for(PyId node = parent_; node > 0; node = nodes_[node]->parent_) {
-                PyId nextId = nodes_[node]->id_;
-                buff << " " << strs[nextId].substr(1);
-                path.push_back(nextId);
-            }
-        }
-        string myId = buff.str();
+    // the probabilities of the words with tables here, in word order,
+    //  given the probabilities of the same words in the parent context
+    //  (sorted by word), or the base probabilities at the root
+    void getTableProbs(const vector< pair<T,LMProb> > * parentProbs, const LMProb* bases, 
+                        const vector<LMProb> & strens, const vector<LMProb> & discs, int lev,
+                        vector< pair<T,LMProb> > & probs) const {
+        const LMProb fallback = getFallbackProb(strens[lev],discs[lev]);
+        const int custCount = tree_.custCounts[pos_];
+        probs.clear();
+        probs.reserve(tables_.size());
         for(typename TableMap::const_iterator it = tables_.begin(); it != tables_.end(); it++) {
-            // get the output prob
-            LMProb myProb = getEmitProb(it->first, bases[it->first], strens, discs);
-            // find the output node and fall back
-            PyId ch = nodes_[0]->findChild(it->first);
-            for(int i = path.size()-1; ch != -1 && i >= 0; i--)
-                ch = nodes_[ch]->findChild(path[i]);
-            os << log(myProb)/log10 << "\t";
-            if(myId.length()) os << myId << " ";
-            os << strs[it->first].substr(1);
-            if(ch != -1) os << "\t" << log(nodes_[ch]->getFallbackProb(strens[lev],discs[lev]))/log10;
-            os << endl;
+            LMProb base;
+            if(parentProbs) {
+                typename vector< pair<T,LMProb> >::const_iterator pit = 
+                    lower_bound(parentProbs->begin(), parentProbs->end(), pair<T,LMProb>(it->first,-1));
+                if(pit != parentProbs->end() && pit->first == it->first)
+                    base = pit->second;
+                else
+                    base = tree_.nodes[tree_.parents[pos_]]->getEmitProb(it->first, bases[it->first], strens, discs, lev-1);
+            }
+            else
+                base = bases[it->first];
+            const vector<int> & tabs = it->second;
+            base *= fallback;
+            probs.push_back(pair<T,LMProb>(it->first, base+(tabs[0]-(tabs.size()-1)*discs[lev])/(strens[lev]+custCount)));
         }
     }
 
+    // update the ids after the tree has been compacted
     void trim(const vector<PyId> & nodeIds, const vector<T> & wordIds) {
         pos_ = nodeIds[pos_];
-        parent_ = parent_==-1?-1:nodeIds[parent_];
-        id_ = (id_==-1?-1:wordIds[id_]);
+        T & id = tree_.ids[pos_];
+        id = (id==-1?-1:wordIds[id]);
         TableMap newTabMap;
         for(typename TableMap::const_iterator it = tables_.begin(); it != tables_.end(); it++)
             newTabMap.insert(pair< T, vector<int> >(wordIds[it->first], it->second));
         tables_ = newTabMap;
-        NodeMap newChildMap;
-        for(typename NodeMap::const_iterator it = children_.begin(); it != children_.end(); it++)
-            newChildMap.insert(pair< T, PyId >(wordIds[it->first], nodeIds[it->second]));
-        children_ = newChildMap;
+        suffix_ = suffix_==-1?-1:nodeIds[suffix_];
+    }
+
+    // re-enter this node into the shared hashes, which must be called
+    //  for every node after they have been cleared by a trim
+    void rehash() {
+        if(tree_.parents[pos_] != -1)
+            tree_.children.set(tree_.parents[pos_], tree_.ids[pos_], pos_);
+        if(suffix_ != -1)
+            tree_.links.set(suffix_, getFirstWord(), pos_);
     }
 
     LMProb getFallbackProb(LMProb s, LMProb d) const {
-        return (s+tableCount_*d)/(s+custCount_);
+        return (s+tree_.tableCounts[pos_]*d)/(s+tree_.custCounts[pos_]);
     }
     LMProb getLocalProb(T emit, LMProb s, LMProb d) const {
         typename TableMap::const_iterator it = tables_.find(emit);
         if(it == tables_.end()) return 0;
         const vector<int> & tabs = it->second;
-        return (tabs[0]-(tabs.size()-1)*d)/(s+custCount_);
+        return (tabs[0]-(tabs.size()-1)*d)/(s+tree_.custCounts[pos_]);
     }
 
     int getLevel() const {
-        return parent_ == -1 ? 0 : nodes_[parent_]->getLevel()+1;
+        return tree_.levels[pos_];
     }
 
     LMProb getEmitProb(T emit, LMProb base, const vector<LMProb>& strens, const vector<LMProb>& discs, int lev = -1) const {
         if(lev == -1)
             lev = getLevel();
-        if(parent_ != -1)
-            base = nodes_[parent_]->getEmitProb(emit,base,strens,discs,lev-1);
+        PyId parent = tree_.parents[pos_];
+        if(parent != -1)
+            base = tree_.nodes[parent]->getEmitProb(emit,base,strens,discs,lev-1);
         base *= getFallbackProb(strens[lev],discs[lev]);
         return base+getLocalProb(emit, strens[lev], discs[lev]); //(tabs[0]-(tabs.size()-1)*discs[lev])/(strens[lev]+custCount_);
     }
     
-    bool checkConsistency(const vector< LMProb > & bases, const vector<LMProb>& strens, const vector<LMProb>& discs, double cutoff = 0.0000001, int lev = -1) const {
-        if(lev == -1)
-            lev = getLevel();
+    // calculate the emission probabilities of many words at once, finding
+    //  the contexts on the path to the root and their fallback probabilities
+    //  only once. At the root with a non-zero base, every id in
+    //  [0,vocabSize) can be emitted, otherwise only words with tables here
+    //  have more than the fallback probability, so only these are returned
+    void getEmitProbs(LMProb base, T vocabSize, const vector<LMProb>& strens, const vector<LMProb>& discs, 
+                        vector< pair<T,LMProb> > & probs) const {
+        const int lev = getLevel();
+        vector<const PyNode*> path(lev+1);
+        for(PyId node = pos_, i = lev; node != -1; node = tree_.parents[node], i--)
+            path[i] = tree_.nodes[node];
+        vector<LMProb> fallbacks(path.size());
+        for(int i = 0; i <= lev; i++)
+            fallbacks[i] = path[i]->getFallbackProb(strens[i],discs[i]);
+        const int custCount = tree_.custCounts[pos_];
+        probs.clear();
+        if(lev == 0 && base != 0) {
+            probs.reserve(vocabSize);
+            typename TableMap::const_iterator it = tables_.begin();
+            for(T id = 0; id < vocabSize; id++) {
+                LMProb prob = base*fallbacks[0];
+                if(it != tables_.end() && it->first == id) {
+                    const vector<int> & tabs = it->second;
+                    prob += (tabs[0]-(tabs.size()-1)*discs[0])/(strens[0]+custCount);
+                    it++;
+                }
+                probs.push_back(pair<T,LMProb>(id,prob));
+            }
+        } else {
+            probs.reserve(tables_.size());
+            for(typename TableMap::const_iterator it = tables_.begin(); it != tables_.end(); it++) {
+                LMProb prob = base;
+                for(int i = 0; i < lev; i++)
+                    prob = prob*fallbacks[i] + path[i]->getLocalProb(it->first, strens[i], discs[i]);
+                const vector<int> & tabs = it->second;
+                prob = prob*fallbacks[lev] + (tabs[0]-(tabs.size()-1)*discs[lev])/(strens[lev]+custCount);
+                probs.push_back(pair<T,LMProb>(it->first,prob));
+            }
+        }
+    }
+    
+    bool checkConsistency(const vector< LMProb > & bases, const vector<LMProb>& strens, const vector<LMProb>& discs, double cutoff = 0.0000001) const {
+        const int lev = getLevel();
         double totalProb = 0;
         for(T i = 0; i < (T)bases.size(); i++) 
             totalProb += getEmitProb(i,bases[i],strens,discs,lev);
         bool consistent = abs(1-totalProb) <= cutoff;
         if(!consistent)
             cerr << "Warning, not consistent (" << 1-totalProb << ")" << endl;
-        for(typename NodeMap::const_iterator it = children_.begin(); it != children_.end(); it++)
-            nodes_[it->second]->checkConsistency(bases,strens,discs,cutoff,lev+1);
         return consistent;
     }
     
@@ -182,12 +441,16 @@ public:
     pair<bool,LMProb> addCustomer(T emit, LMProb base, const vector<LMProb>& strens, const vector<LMProb>& discs, int lev) {
         if(emit < 0)
             throw runtime_error("Attempting to add a negative customer, is something wrong?");
+        int & tableCount = tree_.tableCounts[pos_];
+        int & custCount = tree_.custCounts[pos_];
+        const int oldTables = tableCount, oldCusts = custCount;
+        const PyId parent = tree_.parents[pos_];
         typename TableMap::iterator it = tables_.find(emit);
         pair<bool,LMProb> ret(false,base);
         if(it == tables_.end()) {
             //cerr << "addCustomer("<<(unsigned)emit<<") -- no tables"<<endl;
-            if(parent_ != -1)
-                ret = nodes_[parent_]->addCustomer(emit,base,strens,discs,lev-1);
+            if(parent != -1)
+                ret = tree_.nodes[parent]->addCustomer(emit,base,strens,discs,lev-1);
             else {
                 //cerr << " --> BASE"<<endl;
                 ret.first = true;
@@ -195,14 +458,15 @@ public:
             ret.second *= getFallbackProb(strens[lev],discs[lev]);
             vector<int> tabs(2,1);
             tables_.insert(pair< T,vector<int> >(emit,tabs));
-            tableCount_++;
+            tree_.typeCounts[pos_]++;
+            tableCount++;
         }
         else {
             // calculate
             vector<int> & tabs = it->second;
-            LMProb baseProb = (parent_ == -1?base:nodes_[parent_]->getEmitProb(emit,base,strens,discs,lev-1));
-            LMProb totalProb = baseProb * (strens[lev]+tableCount_*discs[lev]) + (tabs[0] - (tabs.size()-1)*discs[lev]);
-            ret.second = totalProb/(strens[lev]+custCount_);
+            LMProb baseProb = (parent == -1?base:tree_.nodes[parent]->getEmitProb(emit,base,strens,discs,lev-1));
+            LMProb totalProb = baseProb * (strens[lev]+tableCount*discs[lev]) + (tabs[0] - (tabs.size()-1)*discs[lev]);
+            ret.second = totalProb/(strens[lev]+custCount);
             totalProb *= (LMProb)rand()/RAND_MAX;
             int i;
             for(i = tabs.size()-1; i > 0; i--) {
@@ -214,24 +478,30 @@ public:
             if(i == 0) {
                 i = tabs.size();
                 tabs.push_back(0);
-                if(parent_ != -1)
-                    ret.first = nodes_[parent_]->addCustomer(emit,base,strens,discs,lev-1).first;
+                if(parent != -1)
+                    ret.first = tree_.nodes[parent]->addCustomer(emit,base,strens,discs,lev-1).first;
                 else
                     ret.first = true;
-                tableCount_++;
+                tableCount++;
             }
             // modify
+            if(tabs[i] > 1) removeCount(tree_.counts[lev].tableCustCounts, tabs[i]);
             tabs[i]++;
+            if(tabs[i] > 1) addCount(tree_.counts[lev].tableCustCounts, tabs[i]);
             tabs[0]++;
         }
-        custCount_++;
+        custCount++;
+        updateNodeCounts(oldTables, oldCusts, lev);
         return ret;
     }
 
-    bool removeCustomer(T emit) {
+    bool removeCustomer(T emit, int lev) {
         typename TableMap::iterator it = tables_.find(emit);
         if(it == tables_.end())
             throw runtime_error("Attempt to remove non-existent customer");
+        int & tableCount = tree_.tableCounts[pos_];
+        int & custCount = tree_.custCounts[pos_];
+        const int oldTables = tableCount, oldCusts = custCount;
         vector<int> & tabs = it->second;
         int i = tabs.size()-1;
         if(tabs.size() > 2) {
@@ -244,93 +514,192 @@ public:
             if(i == 0)
                 throw runtime_error("Error in removeCustomer");
         }
+        if(tabs[i] > 1) removeCount(tree_.counts[lev].tableCustCounts, tabs[i]);
         tabs[i]--;
+        if(tabs[i] > 1) addCount(tree_.counts[lev].tableCustCounts, tabs[i]);
         tabs[0]--;
-        custCount_--;
+        custCount--;
 
         bool base = false;
         if(tabs[i] == 0) {
-            PyNode<T>* myParent = (parent_==-1?0:nodes_[parent_]);
-            tableCount_--;
-            if(tabs[0] == 0)
+            const PyId parent = tree_.parents[pos_];
+            PyNode<T>* myParent = (parent==-1?0:tree_.nodes[parent]);
+            tableCount--;
+            if(tabs[0] == 0) {
                 tables_.erase(emit);
+                tree_.typeCounts[pos_]--;
+            }
             else
                 tabs.erase(tabs.begin()+i);
+            updateNodeCounts(oldTables, oldCusts, lev);
             if(myParent) {
-                if(custCount_ == 0)
-                    myParent->removeChild(id_);
-                base = myParent->removeCustomer(emit);
+                // this node is deleted if it is empty, so members cannot
+                //  be accessed after this
+                if(custCount == 0)
+                    myParent->removeChild(tree_.ids[pos_]);
+                base = myParent->removeCustomer(emit, lev-1);
             }
             else
                 base = true;
         }
+        else
+            updateNodeCounts(oldTables, oldCusts, lev);
         return base;
     }
 
+    // update the histograms of the level after the table and customer
+    //  counts of this node have changed
+    void updateNodeCounts(int oldTables, int oldCusts, int lev) {
+        PyLevelCounts & counts = tree_.counts[lev];
+        if(oldTables > 1) {
+            removeCount(counts.nodeTableCounts, oldTables);
+            removeCount(counts.nodeCustCounts, oldCusts);
+        }
+        const int tableCount = tree_.tableCounts[pos_];
+        if(tableCount > 1) {
+            addCount(counts.nodeTableCounts, tableCount);
+            addCount(counts.nodeCustCounts, tree_.custCounts[pos_]);
+        }
+    }
+
+    // add the tables of a word read from a saved model, tabs[0] first
+    void addTables(T emit, const vector<int> & tabs, int lev) {
+        if(tabs.size() < 2 || tables_.find(emit) != tables_.end())
+            throw runtime_error("Bad table list in addTables");
+        const int oldTables = tree_.tableCounts[pos_], oldCusts = tree_.custCounts[pos_];
+        tables_[emit] = tabs;
+        tree_.tableCounts[pos_] += tabs.size()-1;
+        tree_.custCounts[pos_] += tabs[0];
+        tree_.typeCounts[pos_]++;
+        for(unsigned j = 1; j < tabs.size(); j++)
+            if(tabs[j] > 1)
+                addCount(tree_.counts[lev].tableCustCounts, tabs[j]);
+        updateNodeCounts(oldTables, oldCusts, lev);
+    }
+
+    // seat the customers of a pruned child's tables for emit here. Each
+    //  of the child's tables already sends one customer to a table here,
+    //  so the rest of its customers join that table, which is drawn in
+    //  proportion to the table sizes
+    void mergeTables(T emit, const vector<int> & childTabs, int lev) {
+        typename TableMap::iterator it = tables_.find(emit);
+        if(it == tables_.end())
+            throw runtime_error("Attempt to merge into non-existent table");
+        int & custCount = tree_.custCounts[pos_];
+        const int oldTables = tree_.tableCounts[pos_], oldCusts = custCount;
+        vector<int> & tabs = it->second;
+        for(unsigned j = 1; j < childTabs.size(); j++) {
+            int extra = childTabs[j]-1;
+            if(extra == 0) continue;
+            int i, left = rand()%tabs[0];
+            for(i = tabs.size()-1; i > 1; i--) {
+                left -= tabs[i];
+                if(left < 0)
+                    break;
+            }
+            if(tabs[i] > 1) removeCount(tree_.counts[lev].tableCustCounts, tabs[i]);
+            tabs[i] += extra;
+            addCount(tree_.counts[lev].tableCustCounts, tabs[i]);
+            tabs[0] += extra;
+            custCount += extra;
+        }
+        updateNodeCounts(oldTables, oldCusts, lev);
+    }
+
+    // an estimate of the memory used by the tables
+    size_t getTableBytes() const {
+        // map entries carry a header of three pointers and a color
+        size_t ret = tables_.size()*(sizeof(typename TableMap::value_type)+4*sizeof(void*));
+        for(typename TableMap::const_iterator it = tables_.begin(); it != tables_.end(); it++)
+            ret += it->second.capacity()*sizeof(int);
+        return ret;
+    }
+
     void removeChild(T emit) {
-        typename NodeMap::iterator it = children_.find(emit);
-        if(it == children_.end())
+        PyId ch = findChild(emit);
+        if(ch == -1)
             throw runtime_error("Attempt to remove non-existant child");
-        delete nodes_[it->second];
-        nodes_[it->second] = 0;
-        children_.erase(emit);
+        tree_.nodes[ch]->clearLinks();
+        delete tree_.nodes[ch];
+        tree_.nodes[ch] = 0;
+        tree_.children.erase(pos_, emit);
+        tree_.childCounts[pos_]--;
     }
 
     PyId findChild(T emit) const {
-        typename NodeMap::const_iterator it = children_.find(emit);
-        return (it!=children_.end()?it->second:-1);
+        return tree_.children.find(pos_, emit);
     }
     
     PyId addChild(T emit) {
         PyId ret = findChild(emit);
-        if(ret != -1) return ret;
-        ret = nodes_.size();
-        children_.insert(pair<T,PyId>(emit,ret));
-        nodes_.push_back(new PyNode(nodes_, ret, emit, pos_));
+        if(ret != -1 || tree_.frozen[pos_]) return ret;
+        ret = tree_.add(emit, pos_);
+        tree_.children.set(pos_, emit, ret);
+        tree_.nodes[ret] = new PyNode(tree_, ret);
+        tree_.childCounts[pos_]++;
         return ret;
     }
-    
-    void addCount(CountMap & map, int place) {
-        pair<CountMap::iterator,bool> p = map.insert(pair<int,int>(place,0));
-        p.first->second++;
-    }
-    void gatherCounts(CountMap & nodeCustCounts,CountMap & nodeTableCounts,CountMap & tableCustCounts, int & totalCustCount, int & totalTableCount, int lev) {
-        if(lev == 0) {
-            totalCustCount += custCount_;
-            totalTableCount += tableCount_;
-            pair<CountMap::iterator,bool> ret;
-            if(tableCount_ > 1) {
-                addCount(nodeTableCounts,tableCount_);
-                addCount(nodeCustCounts,custCount_);
-            }
-            for(typename TableMap::const_iterator it = tables_.begin(); it != tables_.end(); it++) {
-                const vector<int> & tabs = it->second;
-                const int tabsize = tabs.size();
-                for(int i = 1; i < tabsize; i++)
-                    if(tabs[i] > 1)
-                        addCount(tableCustCounts,tabs[i]);
-            }
-        } else {
-            for(typename NodeMap::iterator it = children_.begin(); it != children_.end(); it++)
-                nodes_[it->second]->gatherCounts(nodeCustCounts,nodeTableCounts,tableCustCounts,totalCustCount,totalTableCount,lev-1);
+
+    PyId findLink(T emit) const {
+        return tree_.links.find(pos_, emit);
+    }
+
+    // cache next as the context that follows this one when emit is seen
+    void addLink(T emit, PyId next) {
+        tree_.links.set(pos_, emit, next);
+        tree_.nodes[next]->suffix_ = pos_;
+    }
+
+    // remove the link into this node before it is deleted. Links out of
+    //  this node are left in the hash, as they can no longer be reached
+    //  and are dropped at the next trim
+    void clearLinks() {
+        if(suffix_ != -1) {
+            tree_.links.erase(suffix_, getFirstWord());
+            suffix_ = -1;
         }
     }
 
+    // the first word of the context, which is found at the top of the tree
+    T getFirstWord() const {
+        PyId first = pos_;
+        while(tree_.parents[first] > 0)
+            first = tree_.parents[first];
+        return tree_.ids[first];
+    }
+    
+    // the context of the word after emit: the longest existing context
+    //  made of emit and the words of this one, dropping the oldest word of
+    //  a full context. Links only cache this, so the result does not
+    //  depend on whether one is cached
     const PyId nextContext(T emit) const {
-        if(parent_ == -1) 
-            return findChild(emit);
-        PyId ret = nodes_[parent_]->nextContext(emit), ret2 = -1;
-        if(ret != -1 && hasChildren())
-            ret2 = nodes_[ret]->findChild(id_);
-        return (ret2==-1?ret:ret2);
+        const int lev = getLevel(), maxLev = tree_.getMaxLevel();
+        const PyId parent = tree_.parents[pos_];
+        if(maxLev == 0)
+            return 0;
+        if(lev == maxLev)
+            return tree_.nodes[parent]->nextContext(emit);
+        PyId next = findLink(emit);
+        if(next != -1)
+            return next;
+        if(parent == -1) {
+            next = findChild(emit);
+            return (next==-1?0:next);
+        }
+        // extend the successor of the parent by the last word
+        const PyId prev = tree_.nodes[parent]->nextContext(emit);
+        if(tree_.levels[prev] == lev)
+            next = tree_.nodes[prev]->findChild(tree_.ids[pos_]);
+        return (next==-1?prev:next);
     }
 
-    T getId() const { return id_; }
-    int getCustomerCount() const { return custCount_; }
-    int getTableCount() const { return tableCount_; }
+    T getId() const { return tree_.ids[pos_]; }
+    int getCustomerCount() const { return tree_.custCounts[pos_]; }
+    int getTableCount() const { return tree_.tableCounts[pos_]; }
     bool hasTable(T id) { return tables_.find(id) != tables_.end(); }
-    bool hasChildren() const { return children_.size() != 0; }
-    PyNode* getParent() const { return nodes_[parent_]; }
+    bool hasChildren() const { return tree_.childCounts[pos_] != 0; }
+    PyNode* getParent() const { return tree_.nodes[tree_.parents[pos_]]; }
+    PyId getParentPos() const { return tree_.parents[pos_]; }
     PyId getPos() const { return pos_; }
     const TableMap & getTables() const { return tables_; }
 
@@ -362,18 +731,31 @@ private:
     int n_;
 
     vector<int> basePos_;
-    vector< PyNode<T>* > nodes_;
+    vector<int> remBasePos_;
+    PyTree<T> tree_;
+
+    // incremented whenever the probabilities of the model change, so that
+    //  values computed from the model can be cached against it
+    unsigned long version_;
 
 public:
 
     // ctor/dtor
-    PyLM(int n) : discs_(n,DEFAULT_DISC), strens_(n,DEFAULT_STREN), n_(n), basePos_(), nodes_() {
-        nodes_.push_back(new PyNode<T>(nodes_));
+    PyLM(int n) : discs_(n,DEFAULT_DISC), strens_(n,DEFAULT_STREN), n_(n), basePos_(), remBasePos_(), tree_(n), version_(0) {
+        tree_.nodes[tree_.add(-1, -1)] = new PyNode<T>(tree_);
+    }
+    // a deep copy, which shares nothing with the original. Copying the tree
+    //  copies its arrays and hashes, but only the pointers to its nodes
+    PyLM(const PyLM<T> & other) : discs_(other.discs_), strens_(other.strens_), n_(other.n_), 
+            basePos_(other.basePos_), remBasePos_(other.remBasePos_), tree_(other.tree_), version_(other.version_) {
+        for(unsigned i = 0; i < tree_.size(); i++)
+            if(tree_.nodes[i])
+                tree_.nodes[i] = new PyNode<T>(tree_, *tree_.nodes[i]);
     }
     ~PyLM() {
-        for(unsigned i = 0; i < nodes_.size(); i++)
-            if(nodes_[i])
-                delete nodes_[i];
+        for(unsigned i = 0; i < tree_.size(); i++)
+            if(tree_.nodes[i])
+                delete tree_.nodes[i];
     }
 
     // getters/setters
@@ -381,10 +763,12 @@ public:
     LMProb getStrength(int m) { return strens_[m]; }
     const vector<LMProb> & getDiscounts() const { return discs_; }
     const vector<LMProb> & getStrengths() const { return strens_; }
-    int getN() { return n_; }
-    PyNode<T> & getRoot() { return *nodes_[0]; }
-    const PyNode<T> & getRoot() const { return *nodes_[0]; }
+    int getN() const { return n_; }
+    PyNode<T> & getRoot() { return *tree_.nodes[0]; }
+    const PyNode<T> & getRoot() const { return *tree_.nodes[0]; }
     const vector<int> & getBasePositions() { return basePos_; }
+    const vector<int> & getRemovedBasePositions() { return remBasePos_; }
+    unsigned long getVersion() const { return version_; }
 
     // calculate likelihood/add tables
     LMProb calcSentence(const vector<T> & words, const vector<LMProb> & baseProbs, bool add = true) {
@@ -394,28 +778,22 @@ public:
     }
     LMProb calcSentence(const T* words, const LMProb* baseProbs, int len, bool add = true) {
         basePos_.clear();
-        int i, j;
+        if(add)
+            version_++;
         LMProb prob = 0;
-        for(i = 0; i < len; i++) {
+        vector<PyId> contexts;
+        vector<int> levs;
+        findContexts(words, len, add, contexts, levs);
+        for(int i = 0; i < len; i++) {
             T emit = words[i];
-            //cerr << "calcSentence["<<i<<"] = "<<emit<<endl;
-            PyId node = 0, next = -1;
-            // get the total probability
-            for(j = 1; j < (int)n_ && i-j >= -1; j++) {
-                if(add)
-                    next = nodes_[node]->addChild((i-j==-1?0:words[i-j]));
-                else
-                    next = nodes_[node]->findChild((i-j==-1?0:words[i-j]));
-                if(next == -1) break;
-                node = next;
-            }
             if(add) {
-                pair<bool,LMProb> res = nodes_[node]->addCustomer(emit, baseProbs[i], strens_, discs_, j-1);
+                pair<bool,LMProb> res = tree_.nodes[contexts[i]]->addCustomer(emit, baseProbs[i], strens_, discs_, levs[i]);
                 prob += log(res.second);
                 if(res.first) basePos_.push_back(i);
+                addOrphan(words, i, contexts[i], levs[i]);
             } 
             else 
-                prob += log(nodes_[node]->getEmitProb(emit,baseProbs[i], strens_, discs_, j-1));
+                prob += log(tree_.nodes[contexts[i]]->getEmitProb(emit,baseProbs[i], strens_, discs_, levs[i]));
         }
         return prob;
     }
@@ -426,79 +804,584 @@ public:
     }
     void removeCustomers(const T* words, int len) {
         basePos_.clear();
-        int i, myN;
-        for(i = 0; i < len; i++) {
-            T emit = words[i];
-            PyId node = 0;
-            for(myN = 1; myN < (int)n_ && i-myN >= -1; myN++) {
-                node = nodes_[node]->findChild(i-myN==-1?0:words[i-myN]);
-                if(node == -1) { 
-                    throw runtime_error("Couldn't find node to be deleted");
+        version_++;
+        removeSentence(words, len, vector<bool>(len, false), basePos_);
+    }
+
+    // replace the customers of oldWords with those of newWords, removing
+    //  and adding only the customers whose n-grams differ between the two
+    //  and leaving the shared ones seated. The positions of oldWords whose
+    //  removal reached the base are kept in getRemovedBasePositions(), and
+    //  those of newWords that were added to the base in getBasePositions().
+    //  The likelihood of all of newWords is returned
+    LMProb replaceSentence(const vector<T> & oldWords, const vector<T> & newWords, const vector<LMProb> & newBases) {
+        vector<bool> newKept = removeChangedCustomers(oldWords, newWords);
+        return addChangedCustomers(newWords, newBases, newKept);
+    }
+
+    // the first half of replaceSentence, which removes the customers of
+    //  oldWords whose n-grams are not in newWords and returns the positions
+    //  of newWords whose customers are still seated. The base can be
+    //  updated for the removals before the bases of newWords are found
+    vector<bool> removeChangedCustomers(const vector<T> & oldWords, const vector<T> & newWords) {
+        remBasePos_.clear();
+        version_++;
+        // match the positions with the same n-grams
+        map< vector<T>, vector<int> > oldPos;
+        vector< vector<T> > oldGrams = getNgrams(oldWords), newGrams = getNgrams(newWords);
+        for(int i = oldGrams.size()-1; i >= 0; i--)
+            oldPos[oldGrams[i]].push_back(i);
+        vector<bool> oldKept(oldWords.size(), false), newKept(newWords.size(), false);
+        for(unsigned i = 0; i < newGrams.size(); i++) {
+            typename map< vector<T>, vector<int> >::iterator it = oldPos.find(newGrams[i]);
+            if(it != oldPos.end() && it->second.size()) {
+                oldKept[it->second.back()] = true;
+                newKept[i] = true;
+                it->second.pop_back();
+            }
+        }
+        removeSentence(&oldWords[0], oldWords.size(), oldKept, remBasePos_);
+        return newKept;
+    }
+
+    // the second half of replaceSentence, which adds the customers of
+    //  newWords that are not kept and returns the likelihood of newWords
+    LMProb addChangedCustomers(const vector<T> & newWords, const vector<LMProb> & newBases, const vector<bool> & newKept) {
+        if(newWords.size() > newBases.size() || newWords.size() != newKept.size())
+            throw runtime_error("word size and base probability size must match in addChangedCustomers");
+        basePos_.clear();
+        version_++;
+        const int newLen = newWords.size();
+        LMProb prob = 0;
+        vector<PyId> contexts;
+        vector<int> levs;
+        findContexts(&newWords[0], newLen, true, contexts, levs);
+        for(int i = 0; i < newLen; i++) {
+            T emit = newWords[i];
+            PyNode<T>* node = tree_.nodes[contexts[i]];
+            if(newKept[i])
+                prob += log(node->getEmitProb(emit, newBases[i], strens_, discs_, levs[i]));
+            else {
+                pair<bool,LMProb> res = node->addCustomer(emit, newBases[i], strens_, discs_, levs[i]);
+                prob += log(res.second);
+                if(res.first) basePos_.push_back(i);
+                addOrphan(&newWords[0], i, contexts[i], levs[i]);
+            }
+        }
+        // a kept customer that is an orphan can have had its context
+        //  created above, which is left without customers
+        for(int i = 0; i < newLen; i++)
+            if(newKept[i])
+                removeEmptyContext(contexts[i]);
+        return prob;
+    }
+
+    // remove a context with no customers and the empty contexts above it
+    void removeEmptyContext(PyId node) {
+        while(node > 0 && tree_.nodes[node] && tree_.custCounts[node] == 0 && tree_.childCounts[node] == 0) {
+            const PyId parent = tree_.parents[node];
+            tree_.nodes[parent]->removeChild(tree_.ids[node]);
+            node = parent;
+        }
+    }
+
+    // the n-gram of each position of a sentence, the word followed by its
+    //  context, which identifies the customer that the position adds
+    vector< vector<T> > getNgrams(const vector<T> & words) const {
+        vector< vector<T> > ret(words.size());
+        for(int i = 0; i < (int)words.size(); i++) {
+            ret[i].push_back(words[i]);
+            for(int j = 1; j < n_ && i-j >= -1; j++)
+                ret[i].push_back(i-j==-1?0:words[i-j]);
+        }
+        return ret;
+    }
+
+    // find the context of each word of a sentence and its length, creating
+    //  the contexts if add is set. Contexts are followed along the successor
+    //  links, except after one that was cut short by a frozen context,
+    //  where the next one is found by walking down from the root
+    void findContexts(const T* words, int len, bool add, vector<PyId> & contexts, vector<int> & levs) {
+        contexts.resize(len);
+        levs.resize(len);
+        int lev;
+        PyId node = startContext(lev, add);
+        for(int i = 0; i < len; i++) {
+            contexts[i] = node;
+            levs[i] = lev;
+            if(i+1 == len)
+                break;
+            if(lev < min(i+1, n_-1))
+                node = walkContext(words, i+1, lev, add);
+            else
+                node = nextContext(node, lev, words[i], add);
+        }
+    }
+
+    // the word that extends the context of position i beyond lev words
+    T getContextWord(const T* words, int i, int lev) const {
+        return (i-1-lev < 0 ? 0 : words[i-1-lev]);
+    }
+
+    // record a customer added to a context that was cut short by a frozen
+    //  context as an orphan, so that it is removed from the same context
+    void addOrphan(const T* words, int i, PyId context, int lev) {
+        if(lev < min(i+1, n_-1))
+            tree_.addOrphans(context, getContextWord(words, i, lev), words[i], 1);
+    }
+
+    // remove the customers of the positions of a sentence that are not
+    //  kept, adding the positions whose removal reached the base to basePos
+    void removeSentence(const T* words, int len, const vector<bool> & kept, vector<int> & basePos) {
+        if(tree_.orphans.empty()) {
+            // find all the contexts first, as removing customers can delete
+            //  the nodes that the successor links pass through
+            vector<PyId> contexts;
+            vector<int> levs;
+            findRemovalContexts(words, len, contexts, levs);
+            for(int i = 0; i < len; i++)
+                if(!kept[i] && tree_.nodes[contexts[i]]->removeCustomer(words[i], levs[i]))
+                    basePos.push_back(i);
+        } else {
+            // each context is found by walking down from the root, so the
+            //  customers can be removed as soon as they are found
+            for(int i = 0; i < len; i++) {
+                if(kept[i]) continue;
+                int lev;
+                PyId context = findOrphanContext(words, i, lev);
+                if(tree_.nodes[context]->removeCustomer(words[i], lev))
+                    basePos.push_back(i);
+            }
+        }
+    }
+
+    // find the contexts of a sentence whose customers are to be removed,
+    //  which must all exist when there are no orphans
+    void findRemovalContexts(const T* words, int len, vector<PyId> & contexts, vector<int> & levs) {
+        findContexts(words, len, false, contexts, levs);
+        for(int i = 0; i < len; i++)
+            if(levs[i] != min(i+1, n_-1))
+                throw runtime_error("Couldn't find node to be deleted");
+    }
+
+    // find the context to remove the customer at position i from when some
+    //  customers are orphans. This is the deepest context on the word's
+    //  path that holds one, either its own context or one with an orphan,
+    //  which leaves the less specific orphans for the other paths
+    PyId findOrphanContext(const T* words, int i, int & lev) {
+        const int full = min(i+1, n_-1);
+        const T emit = words[i];
+        PyId node = 0, ret = -1;
+        for(int j = 0; node != -1; j++) {
+            if(j == full) {
+                if(tree_.nodes[node]->getTables().count(emit)) {
+                    lev = j;
+                    return node;
                 }
+                break;
+            }
+            const T word = getContextWord(words, i, j);
+            if(tree_.orphans.count(make_pair(node, make_pair(word, emit)))) {
+                ret = node;
+                lev = j;
             }
-            if(nodes_[node]->removeCustomer(emit))
-                basePos_.push_back(i);
+            node = tree_.nodes[node]->findChild(word);
+        }
+        if(ret == -1)
+            throw runtime_error("Couldn't find node to be deleted");
+        tree_.removeOrphan(ret, getContextWord(words, i, lev), emit);
+        return ret;
+    }
+
+    // find the context of the word at position i by walking down from the
+    //  root through the previous words
+    PyId walkContext(const T* words, int i, int & lev, bool add) {
+        PyId node = 0;
+        lev = 0;
+        for(int j = 1; j < n_ && i-j >= -1; j++) {
+            T word = (i-j==-1?0:words[i-j]);
+            PyId next = (add ? tree_.nodes[node]->addChild(word) : tree_.nodes[node]->findChild(word));
+            if(next == -1) break;
+            node = next;
+            lev = j;
         }
+        return node;
+    }
+
+    // the context of the first word of a sentence, and its length in lev
+    PyId startContext(int & lev, bool add = false) {
+        lev = 0;
+        if(n_ == 1)
+            return 0;
+        PyId ret = (add ? tree_.nodes[0]->addChild(0) : tree_.nodes[0]->findChild(0));
+        if(ret == -1)
+            return 0;
+        lev = 1;
+        return ret;
     }
 
-    // print lm
-    void print(const string* strs, const LMProb* bases, ostream & out = cout) const { 
+    // slide the context ctx of length lev past the word emit, returning
+    //  the context of the next word and updating lev. Successor links are
+    //  cached on contexts shorter than n-1 when add is set, so this is
+    //  usually a single lookup, and lookups without add only read the
+    //  model. If add is false and the full context does not exist, the
+    //  longest existing one is returned
+    PyId nextContext(PyId ctx, int & lev, T emit, bool add = false) {
+        if(n_ == 1)
+            return 0;
+        // the oldest word falls out of a full context
+        if(lev == n_-1) {
+            ctx = tree_.nodes[ctx]->getParentPos();
+            lev--;
+        }
+        PyNode<T>* node = tree_.nodes[ctx];
+        PyId next = node->findLink(emit);
+        if(next != -1) {
+            lev++;
+            return next;
+        }
+        if(lev == 0)
+            next = (add ? node->addChild(emit) : node->findChild(emit));
+        else {
+            // extend the successor of the parent by the last word
+            int prevLev = lev-1;
+            PyId prev = nextContext(node->getParentPos(), prevLev, emit, add);
+            if(prevLev == lev)
+                next = (add ? tree_.nodes[prev]->addChild(node->getId()) : tree_.nodes[prev]->findChild(node->getId()));
+            if(next == -1) {
+                lev = prevLev;
+                return prev;
+            }
+        }
+        if(next == -1)
+            return 0;
+        if(add)
+            node->addLink(emit, next);
+        lev++;
+        return next;
+    }
+
+    // print lm in ARPA format. The probabilities of each level are found
+    //  from those of the level above, and the lines of each level are
+    //  formatted by numThreads threads in chunks of nodes, which are then
+    //  written in order with one write each
+    void print(const string* strs, const LMProb* bases, ostream & out = cout, int numThreads = 1) const { 
         vector<unsigned> counts(n_);
-        nodes_[0]->accumulateCounts(counts,0);
+        vector< vector<PyId> > levelNodes(n_);
+        for(unsigned i = 0; i < tree_.size(); i++) {
+            if(tree_.nodes[i]) {
+                counts[tree_.levels[i]] += tree_.typeCounts[i];
+                levelNodes[tree_.levels[i]].push_back(i);
+            }
+        }
         out << "[unifb]" << endl << 
-            log(nodes_[0]->getFallbackProb(strens_[0], discs_[0]))/log(10) << endl << endl <<
+            log(tree_.nodes[0]->getFallbackProb(strens_[0], discs_[0]))/log(10) << endl << endl <<
             "\\data\\" << endl;
-        for(unsigned i = 0; i < n_; i++)
+        for(int i = 0; i < n_; i++)
             out << "ngram "<<i+1<<"="<<counts[i]<<endl;
-        for(unsigned i = 0; i < n_; i++) {
+        const int chunkSize = 256, batchSize = max(numThreads,1)*8;
+        vector< vector< pair<T,LMProb> > > probs(tree_.size());
+        for(int i = 0; i < n_; i++) {
             out << endl << "\\" << i+1 << "-grams:" << endl;
-            nodes_[0]->print(0,i,strs,bases,strens_,discs_,out);
+            const vector<PyId> & nodes = levelNodes[i];
+            const int numChunks = (nodes.size()+chunkSize-1)/chunkSize;
+            latticelm::ParallelFor(numChunks, numThreads, [&](int chunk) {
+                for(int j = chunk*chunkSize; j < min((chunk+1)*chunkSize,(int)nodes.size()); j++) {
+                    PyId node = nodes[j], parent = tree_.parents[node];
+                    tree_.nodes[node]->getTableProbs(parent == -1 ? 0 : &probs[parent], bases, strens_, discs_, i, probs[node]);
+                }
+            });
+            vector<string> bufs(batchSize);
+            for(int start = 0; start < numChunks; start += batchSize) {
+                const int end = min(start+batchSize, numChunks);
+                latticelm::ParallelFor(end-start, numThreads, [&](int k) {
+                    bufs[k].clear();
+                    for(int j = (start+k)*chunkSize; j < min((start+k+1)*chunkSize,(int)nodes.size()); j++)
+                        printContext(nodes[j], i, probs[nodes[j]], strs, bufs[k]);
+                });
+                for(int k = 0; k < end-start; k++)
+                    out.write(bufs[k].data(), bufs[k].size());
+            }
+            // the level above is no longer needed
+            if(i > 0)
+                for(unsigned j = 0; j < levelNodes[i-1].size(); j++)
+                    vector< pair<T,LMProb> >().swap(probs[levelNodes[i-1][j]]);
+        }
+    }
+
+    // append the ARPA lines of the words with tables in a context to buf
+    void printContext(PyId node, int lev, const vector< pair<T,LMProb> > & probs, const string* strs, string & buf) const {
+        const LMProb log10 = log(10);
+        // the context words, oldest first
+        string context;
+        vector<PyId> path;
+        for(PyId ctx = node; ctx > 0; ctx = tree_.parents[ctx]) {
+            context.append(strs[tree_.ids[ctx]], 1, string::npos);
+            context += ' ';
+            path.push_back(tree_.ids[ctx]);
+        }
+        char num[32];
+        for(unsigned i = 0; i < probs.size(); i++) {
+            const T word = probs[i].first;
+            snprintf(num, sizeof(num), "%g\t", log(probs[i].second)/log10);
+            buf += num;
+            buf += context;
+            buf.append(strs[word], 1, string::npos);
+            // the context extended by this word, for the backoff weight
+            PyId ch = -1;
+            if(lev < n_-1) {
+                ch = tree_.links.find(node, word);
+                if(ch == -1) {
+                    ch = tree_.children.find(0, word);
+                    for(int j = path.size()-1; ch != -1 && j >= 0; j--)
+                        ch = tree_.children.find(ch, path[j]);
+                }
+            }
+            if(ch != -1) {
+                snprintf(num, sizeof(num), "\t%g", log(tree_.nodes[ch]->getFallbackProb(strens_[lev],discs_[lev]))/log10);
+                buf += num;
+            }
+            buf += '\n';
+        }
+    }
+
+    // write the model in binary, with the contexts in the order of the
+    //  tree so that parents come before their children
+    void write(ostream & out) const {
+        latticelm::WriteBinary(out, (int32_t)n_);
+        latticelm::WriteBinary(out, vector<double>(discs_.begin(), discs_.end()));
+        latticelm::WriteBinary(out, vector<double>(strens_.begin(), strens_.end()));
+        vector<int32_t> newIds(tree_.size(), -1);
+        int32_t numNodes = 0;
+        for(unsigned i = 0; i < tree_.size(); i++)
+            if(tree_.nodes[i])
+                newIds[i] = numNodes++;
+        latticelm::WriteBinary(out, numNodes);
+        for(unsigned i = 0; i < tree_.size(); i++) {
+            const PyNode<T>* node = tree_.nodes[i];
+            if(!node) continue;
+            latticelm::WriteBinary(out, (int32_t)(tree_.parents[i] == -1 ? -1 : newIds[tree_.parents[i]]));
+            latticelm::WriteBinary(out, (int32_t)tree_.ids[i]);
+            latticelm::WriteBinary(out, (int32_t)tree_.frozen[i]);
+            const typename PyNode<T>::TableMap & tables = node->getTables();
+            latticelm::WriteBinary(out, (int32_t)tables.size());
+            for(typename PyNode<T>::TableMap::const_iterator it = tables.begin(); it != tables.end(); it++) {
+                latticelm::WriteBinary(out, (int32_t)it->first);
+                latticelm::WriteBinary(out, vector<int32_t>(it->second.begin(), it->second.end()));
+            }
+        }
+        latticelm::WriteBinary(out, (int32_t)tree_.orphans.size());
+        for(typename PyTree<T>::OrphanMap::const_iterator it = tree_.orphans.begin(); it != tree_.orphans.end(); it++) {
+            latticelm::WriteBinary(out, newIds[it->first.first]);
+            latticelm::WriteBinary(out, (int32_t)it->first.second.first);
+            latticelm::WriteBinary(out, (int32_t)it->first.second.second);
+            latticelm::WriteBinary(out, (int32_t)it->second);
+        }
+    }
+
+    // read a model written by write()
+    static PyLM<T>* read(istream & in) {
+        int32_t n, numNodes;
+        latticelm::ReadBinary(in, n);
+        if(n <= 0)
+            throw runtime_error("Bad n-gram length in PyLM::read");
+        PyLM<T>* ret = new PyLM<T>(n);
+        try {
+            vector<double> discs, strens;
+            latticelm::ReadBinary(in, discs);
+            latticelm::ReadBinary(in, strens);
+            if((int)discs.size() != n || (int)strens.size() != n)
+                throw runtime_error("Bad parameters in PyLM::read");
+            ret->discs_.assign(discs.begin(), discs.end());
+            ret->strens_.assign(strens.begin(), strens.end());
+            PyTree<T> & tree = ret->tree_;
+            latticelm::ReadBinary(in, numNodes);
+            for(int32_t i = 0; i < numNodes; i++) {
+                int32_t parent, id, frozen, numTables;
+                latticelm::ReadBinary(in, parent);
+                latticelm::ReadBinary(in, id);
+                latticelm::ReadBinary(in, frozen);
+                latticelm::ReadBinary(in, numTables);
+                if((parent == -1) != (i == 0) || parent >= i || (parent != -1 && tree.levels[parent] >= n-1))
+                    throw runtime_error("Bad context in PyLM::read");
+                if(i > 0) {
+                    tree.nodes[tree.add(id, parent)] = new PyNode<T>(tree, i);
+                    tree.children.set(parent, id, i);
+                    tree.childCounts[parent]++;
+                }
+                tree.frozen[i] = frozen;
+                vector<int32_t> tabs;
+                for(int32_t j = 0; j < numTables; j++) {
+                    latticelm::ReadBinary(in, id);
+                    latticelm::ReadBinary(in, tabs);
+                    tree.nodes[i]->addTables(id, vector<int>(tabs.begin(), tabs.end()), tree.levels[i]);
+                }
+            }
+            int32_t numOrphans, node, child, emit, num;
+            latticelm::ReadBinary(in, numOrphans);
+            for(int32_t i = 0; i < numOrphans; i++) {
+                latticelm::ReadBinary(in, node);
+                latticelm::ReadBinary(in, child);
+                latticelm::ReadBinary(in, emit);
+                latticelm::ReadBinary(in, num);
+                if(node < 0 || node >= numNodes || num <= 0)
+                    throw runtime_error("Bad orphan in PyLM::read");
+                tree.addOrphans(node, child, emit, num);
+            }
+            ret->linkContexts();
+        } catch(...) {
+            delete ret;
+            throw;
+        }
+        return ret;
+    }
+
+    // add the successor link into every context from the context without
+    //  its first word, as training would have cached them
+    void linkContexts() {
+        vector<T> words;
+        for(unsigned i = 1; i < tree_.size(); i++) {
+            if(!tree_.nodes[i]) continue;
+            words.clear();
+            PyId ctx = i;
+            for( ; tree_.parents[ctx] > 0; ctx = tree_.parents[ctx])
+                words.push_back(tree_.ids[ctx]);
+            PyId source = 0;
+            for(int j = words.size()-1; source != -1 && j >= 0; j--)
+                source = tree_.nodes[source]->findChild(words[j]);
+            if(source != -1)
+                tree_.nodes[source]->addLink(tree_.ids[ctx], i);
         }
     }
 
-    // auxiliary variables method
-    void sampleParameters() {
+    // the memory used by the entries of one node in the tree's arrays
+    static size_t getEntryBytes() {
+        return sizeof(PyNode<T>*) + sizeof(PyId) + sizeof(T) + 5*sizeof(int) + 1;
+    }
+
+    // auxiliary variables method, where rng draws the binomials
+    void sampleParameters(std::mt19937 & rng) {
+        version_++;
         for(int i = n_-1; i >= 0; i--) {
             LMProb stren = strens_[i], disc = discs_[i];
-            CountMap nodeTableCounts, nodeCustCounts, tableCustCounts;
-            int totalCustCount = 0, totalTableCount = 0;
-            nodes_[0]->gatherCounts(nodeCustCounts,nodeTableCounts,tableCustCounts,totalCustCount,totalTableCount,i);
+            const CountMap & nodeTableCounts = tree_.counts[i].nodeTableCounts;
+            const CountMap & nodeCustCounts = tree_.counts[i].nodeCustCounts;
+            const CountMap & tableCustCounts = tree_.counts[i].tableCustCounts;
             LMProb da = PRIOR_DA, db = PRIOR_DB, sa = PRIOR_SA, sb = PRIOR_SB;
-            int yui = 0;
-            for(CountMap::const_iterator it = nodeTableCounts.begin(); it != nodeTableCounts.end(); it++) {
-                for(int j = 1; j < it->first; j++) {
-                    for(int k = 0; k < it->second; k++) {
-                        yui = bernoulliSample(stren/(stren+disc*j));
-                        da += (1-yui);
-                        sa += yui;
-                    }
-                }
+            // every node with more than j tables makes one draw at j, so
+            //  the draws at each j are pooled into a single binomial
+            vector<int> above = countAbove(nodeTableCounts);
+            for(unsigned j = 1; j < above.size(); j++) {
+                int yui = binomialSample(above[j], stren/(stren+disc*j), rng);
+                da += above[j]-yui;
+                sa += yui;
             }
             for(CountMap::const_iterator it = nodeCustCounts.begin(); it != nodeCustCounts.end(); it++)
                 for(int k = 0; k < it->second; k++)
                     sb -= log(betaSample(stren+1,it->first-1));
-            for(CountMap::const_iterator it = tableCustCounts.begin(); it != tableCustCounts.end(); it++)
-                for(int j = 1; j < it->first; j++)
-                    for(int k = 0; k < it->second; k++)
-                        db += (1-bernoulliSample((j-1)/(j-disc)));
+            above = countAbove(tableCustCounts);
+            for(unsigned j = 1; j < above.size(); j++)
+                db += above[j]-binomialSample(above[j], (j-1)/(j-disc), rng);
             discs_[i] = betaSample(da,db);
             strens_[i] = gammaSample(sa,1/sb);
         }
     }
 
-    unsigned getVocabSize() const { return nodes_[0]->getTables().size(); }
-    unsigned size() const { return nodes_.size(); }
-    PyNode<T>* getNode(unsigned id) { return nodes_[id]; }
-    const PyNode<T>* getNode(unsigned id) const { return nodes_[id]; }
+    // check that every context's distribution sums to one
+    bool checkConsistency(const vector<LMProb> & bases, double cutoff = 0.0000001) const {
+        bool consistent = true;
+        for(unsigned i = 0; i < tree_.size(); i++)
+            if(tree_.nodes[i] && !tree_.nodes[i]->checkConsistency(bases, strens_, discs_, cutoff))
+                consistent = false;
+        return consistent;
+    }
+
+    unsigned getVocabSize() const { return tree_.typeCounts[0]; }
+    unsigned size() const { return tree_.size(); }
+    PyNode<T>* getNode(unsigned id) { return tree_.nodes[id]; }
+    const PyNode<T>* getNode(unsigned id) const { return tree_.nodes[id]; }
+
+    // an estimate of the memory used by the model in bytes
+    size_t getMemoryBytes() const {
+        size_t ret = tree_.size()*getEntryBytes() + tree_.children.getBytes() + tree_.links.getBytes();
+        // map entries carry a header of three pointers and a color
+        ret += tree_.orphans.size()*(sizeof(typename PyTree<T>::OrphanMap::value_type)+4*sizeof(void*));
+        for(unsigned i = 0; i < tree_.size(); i++)
+            if(tree_.nodes[i])
+                ret += sizeof(PyNode<T>) + tree_.nodes[i]->getTableBytes();
+        return ret;
+    }
+
+    // merge the leaf contexts with the fewest customers into their parents
+    //  until the model is estimated to use at most maxBytes, returning the
+    //  number of contexts merged. Any context but the root and the start
+    //  of sentence context can be merged. A model that is within thawBytes
+    //  has its frozen contexts thawed instead, so that they can grow their
+    //  children again, which should leave a margin below maxBytes for them
+    //  to grow into
+    int prune(size_t maxBytes, size_t thawBytes) {
+        size_t bytes = getMemoryBytes();
+        if(bytes <= thawBytes)
+            thaw();
+        if(bytes <= maxBytes)
+            return 0;
+        vector< pair<int,PyId> > leaves;
+        for(unsigned i = 0; i < tree_.size(); i++)
+            if(tree_.nodes[i] && tree_.levels[i] >= 1 && tree_.childCounts[i] == 0 &&
+                    (tree_.levels[i] > 1 || tree_.ids[i] != 0))
+                leaves.push_back(pair<int,PyId>(tree_.custCounts[i], i));
+        sort(leaves.begin(), leaves.end());
+        int pruned = 0;
+        for(unsigned i = 0; i < leaves.size() && bytes > maxBytes; i++, pruned++) {
+            PyId leaf = leaves[i].second;
+            bytes -= min(bytes, getEntryBytes() + sizeof(PyNode<T>) + tree_.nodes[leaf]->getTableBytes());
+            pruneContext(leaf);
+        }
+        version_++;
+        return pruned;
+    }
+
+    // allow the frozen contexts to have children added again
+    void thaw() {
+        fill(tree_.frozen.begin(), tree_.frozen.end(), false);
+    }
+
+    // merge a leaf context into its parent, which is then frozen so that
+    //  the words that used the leaf as context keep using the parent. The
+    //  leaf's customers, including its own orphans, become orphans of the
+    //  parent
+    void pruneContext(PyId leaf) {
+        const PyNode<T> & node = *tree_.nodes[leaf];
+        const PyId parent = tree_.parents[leaf];
+        const int lev = tree_.levels[leaf];
+        PyLevelCounts & counts = tree_.counts[lev];
+        const typename PyNode<T>::TableMap & tables = node.getTables();
+        for(typename PyNode<T>::TableMap::const_iterator it = tables.begin(); it != tables.end(); it++) {
+            const vector<int> & tabs = it->second;
+            for(unsigned j = 1; j < tabs.size(); j++)
+                if(tabs[j] > 1) removeCount(counts.tableCustCounts, tabs[j]);
+            tree_.nodes[parent]->mergeTables(it->first, tabs, lev-1);
+            tree_.addOrphans(parent, tree_.ids[leaf], it->first, tabs[0]);
+        }
+        const pair<T,T> least(numeric_limits<T>::min(), numeric_limits<T>::min());
+        tree_.orphans.erase(tree_.orphans.lower_bound(make_pair(leaf, least)), tree_.orphans.lower_bound(make_pair(leaf+1, least)));
+        if(tree_.tableCounts[leaf] > 1) {
+            removeCount(counts.nodeTableCounts, tree_.tableCounts[leaf]);
+            removeCount(counts.nodeCustCounts, tree_.custCounts[leaf]);
+        }
+        tree_.frozen[parent] = true;
+        tree_.nodes[parent]->removeChild(tree_.ids[leaf]);
+    }
 
     // reduce the states and vocabulary
     //  return the vocabulary map
     vector<T> trim(bool trimVocab = true) {
+        version_++;
         // trim the vocabulary ids
         vector<T> nextVocab;
         T nextWord = 1;
         nextVocab.push_back(0);
-        const typename PyNode<T>::TableMap & tm = nodes_[0]->getTables();
+        const typename PyNode<T>::TableMap & tm = tree_.nodes[0]->getTables();
         for(typename PyNode<T>::TableMap::const_iterator it = tm.begin();
                 it != tm.end(); it++) {
             if(trimVocab) {
@@ -512,24 +1395,32 @@ public:
                     nextVocab.push_back(nextVocab.size());
         }
         // get the new node ids
-        vector<int> nextIds(nodes_.size(), -1);
-        vector< PyNode<T>* > nextNodes;
-        for(unsigned i = 0; i < nodes_.size(); i++) {
-            if(nodes_[i] != 0) {
-                nextIds[i] = nextNodes.size();
-                nextNodes.push_back(nodes_[i]);
-            }
-        }
-        nodes_ = nextNodes;
-        // trim each node
-        for(unsigned i = 0; i < nextNodes.size(); i++)
-            nextNodes[i]->trim(nextIds, nextVocab);
+        vector<int> nextIds(tree_.size(), -1);
+        int nextId = 0;
+        for(unsigned i = 0; i < tree_.size(); i++)
+            if(tree_.nodes[i] != 0)
+                nextIds[i] = nextId++;
+        tree_.compact(nextIds);
+        typename PyTree<T>::OrphanMap orphans;
+        for(typename PyTree<T>::OrphanMap::const_iterator it = tree_.orphans.begin(); it != tree_.orphans.end(); it++)
+            orphans[make_pair(nextIds[it->first.first], make_pair(nextVocab[it->first.second.first], nextVocab[it->first.second.second]))] = it->second;
+        tree_.orphans.swap(orphans);
+        // trim each node and rebuild the hashes with the new ids
+        tree_.children.clear();
+        tree_.links.clear();
+        for(unsigned i = 0; i < tree_.size(); i++)
+            tree_.nodes[i]->trim(nextIds, nextVocab);
+        for(unsigned i = 0; i < tree_.size(); i++)
+            tree_.nodes[i]->rehash();
         return nextVocab;
     }
 
 
 private:
 
+    // copies must be made with the copy constructor
+    PyLM & operator=(const PyLM<T> &);
+
     ///////////////////////////////
     // begin numerical functions //
     ///////////////////////////////
@@ -538,6 +1429,27 @@ private:
     static int bernoulliSample(LMProb p) {
         return (rand() < p*RAND_MAX?1:0);
     }
+    static int binomialSample(int n, LMProb p, std::mt19937 & rng) {
+        if(n <= 0 || p <= 0) return 0;
+        if(p >= 1) return n;
+        std::binomial_distribution<int> dist(n, p);
+        return dist(rng);
+    }
+
+    // for a histogram of count->frequency, the number of entries whose
+    //  count is greater than j, for every j below the maximum count
+    static vector<int> countAbove(const CountMap & counts) {
+        int maxCount = 0;
+        for(CountMap::const_iterator it = counts.begin(); it != counts.end(); it++)
+            maxCount = std::max(maxCount, it->first);
+        vector<int> hist(maxCount+1, 0), above(maxCount, 0);
+        for(CountMap::const_iterator it = counts.begin(); it != counts.end(); it++)
+            if(it->first > 0)
+                hist[it->first] += it->second;
+        for(int j = maxCount-1, sum = 0; j >= 0; j--)
+            above[j] = (sum += hist[j+1]);
+        return above;
+    }
     static LMProb gammaSample(LMProb a, LMProb scale) {
         LMProb b, c, e, u, v, w, y, x, z;
         if(a > 1) { // Best's XG method
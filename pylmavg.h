@@ -0,0 +1,214 @@
+/*
+* Copyright 2010, Graham Neubig
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef PYLMAVG_H__
+#define PYLMAVG_H__
+
+#include "pylm.h"
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+
+namespace pylm {
+
+// The average of the LMs of several samples, accumulated one sample at a
+// time. Each sample's probability of a word in a context is its fallback
+// weight times the probability in the parent context, plus a local term
+// from the tables of the word. The average keeps the sums of the local
+// terms and fallback weights of every context and word seen in any
+// sample, and the sums of the base probabilities of the words, so its
+// memory is bounded by the union of the samples' contexts. The averaged
+// probabilities follow the same recursion, which keeps them normalized
+// as each sample's are. This only approximates the mean of the samples'
+// probabilities: it multiplies the average fallback weight by the
+// average parent probability, where the mean averages their product, so
+// the two differ by the covariance of the fallback weight and the parent
+// probability across samples. The exact mean cannot be written with one
+// backoff weight per context, which the printed format needs. Words are
+// identified by name, as the ids of the sampler change when the lexicon
+// is trimmed.
+class PyLMAverage {
+
+    struct Context {
+        int parent, word, level;
+        int present; // the number of samples that had this context
+        double fallbackSum;
+        std::unordered_map<int,double> localSums;
+        Context(int p, int w, int l) : parent(p), word(w), level(l), present(0), fallbackSum(0), localSums() { }
+    };
+
+    vector<Context> contexts_;
+    std::unordered_map<unsigned long long,int> children_;
+    std::unordered_map<string,int> wordIds_;
+    vector<string> words_;
+    vector<double> baseSums_;
+    vector<int> baseCounts_;
+    int numSamples_;
+
+    static unsigned long long key(int parent, int word) {
+        return ((unsigned long long)(unsigned)parent << 32) | (unsigned)word;
+    }
+
+    int findChild(int parent, int word) const {
+        std::unordered_map<unsigned long long,int>::const_iterator it = children_.find(key(parent, word));
+        return it == children_.end() ? -1 : it->second;
+    }
+
+    int addChild(int parent, int word) {
+        std::pair<std::unordered_map<unsigned long long,int>::iterator,bool> p =
+            children_.insert(std::make_pair(key(parent, word), (int)contexts_.size()));
+        if(p.second)
+            contexts_.push_back(Context(parent, word, contexts_[parent].level+1));
+        return p.first->second;
+    }
+
+    int findWord(const string & str) {
+        std::pair<std::unordered_map<string,int>::iterator,bool> p =
+            wordIds_.insert(std::make_pair(str, (int)words_.size()));
+        if(p.second) {
+            words_.push_back(str);
+            baseSums_.push_back(0);
+            baseCounts_.push_back(0);
+        }
+        return p.first->second;
+    }
+
+    // the average fallback weight of a context, which is one in the
+    //  samples that did not have it
+    double getFallback(const Context & ctx) const {
+        return (ctx.fallbackSum + numSamples_ - ctx.present) / numSamples_;
+    }
+
+public:
+
+    PyLMAverage() : contexts_(1, Context(-1, -1, 0)), children_(), wordIds_(), words_(),
+                    baseSums_(), baseCounts_(), numSamples_(0) { }
+
+    // add one sample, where strs are the names of the first numWords word
+    //  ids of the LM and bases are their base probabilities
+    template <class T>
+    void add(const PyLM<T> & lm, const string* strs, const LMProb* bases, unsigned numWords) {
+        vector<int> wordIds(numWords);
+        for(unsigned i = 0; i < numWords; i++) {
+            wordIds[i] = findWord(strs[i]);
+            baseSums_[wordIds[i]] += bases[i];
+            baseCounts_[wordIds[i]]++;
+        }
+        const vector<LMProb> & strens = lm.getStrengths(), & discs = lm.getDiscounts();
+        // parents always come before their children in the tree
+        vector<int> ctxIds(lm.size(), -1);
+        for(unsigned i = 0; i < lm.size(); i++) {
+            const PyNode<T>* node = lm.getNode(i);
+            if(!node) continue;
+            const int lev = node->getLevel();
+            PyId parent = node->getParentPos();
+            int ctx = ctxIds[i] = (parent == -1 ? 0 : addChild(ctxIds[parent], wordIds[node->getId()]));
+            const LMProb s = strens[lev], d = discs[lev];
+            contexts_[ctx].present++;
+            contexts_[ctx].fallbackSum += node->getFallbackProb(s, d);
+            const LMProb denom = s + node->getCustomerCount();
+            const typename PyNode<T>::TableMap & tables = node->getTables();
+            for(typename PyNode<T>::TableMap::const_iterator it = tables.begin(); it != tables.end(); it++)
+                contexts_[ctx].localSums[wordIds[it->first]] += (it->second[0]-(it->second.size()-1)*d)/denom;
+        }
+        numSamples_++;
+    }
+
+    int getSampleCount() const { return numSamples_; }
+    unsigned getContextCount() const { return contexts_.size(); }
+
+    // print the averaged LM in the same format as PyLM::print, where names
+    //  are printed after their first character
+    void print(ostream & out = cout) const {
+        if(numSamples_ == 0)
+            throw runtime_error("Attempt to print an average of no samples");
+        const LMProb log10 = log(10);
+        int n = 0;
+        for(unsigned i = 0; i < contexts_.size(); i++)
+            n = max(n, contexts_[i].level+1);
+        vector<unsigned> counts(n, 0);
+        vector< vector<int> > levels(n);
+        for(unsigned i = 0; i < contexts_.size(); i++) {
+            counts[contexts_[i].level] += contexts_[i].localSums.size();
+            levels[contexts_[i].level].push_back(i);
+        }
+        out << "[unifb]" << endl << log(getFallback(contexts_[0]))/log10 << endl << endl <<
+            "\\data\\" << endl;
+        for(int i = 0; i < n; i++)
+            out << "ngram "<<i+1<<"="<<counts[i]<<endl;
+        // the probabilities of each context, sorted by word
+        vector< vector< pair<int,double> > > probs(contexts_.size());
+        char num[32];
+        for(int lev = 0; lev < n; lev++) {
+            out << endl << "\\" << lev+1 << "-grams:" << endl;
+            for(unsigned j = 0; j < levels[lev].size(); j++) {
+                const int c = levels[lev][j];
+                const Context & ctx = contexts_[c];
+                const double fallback = getFallback(ctx);
+                vector< pair<int,double> > & myProbs = probs[c];
+                for(std::unordered_map<int,double>::const_iterator it = ctx.localSums.begin(); it != ctx.localSums.end(); it++)
+                    myProbs.push_back(*it);
+                sort(myProbs.begin(), myProbs.end());
+                // the context words, oldest first
+                string context;
+                vector<int> path;
+                for(int p = c; p > 0; p = contexts_[p].parent) {
+                    context += words_[contexts_[p].word].substr(1) + ' ';
+                    path.push_back(contexts_[p].word);
+                }
+                for(unsigned k = 0; k < myProbs.size(); k++) {
+                    const int word = myProbs[k].first;
+                    double parentProb;
+                    if(ctx.parent == -1) {
+                        parentProb = baseSums_[word]/baseCounts_[word];
+                    } else {
+                        const vector< pair<int,double> > & parentProbs = probs[ctx.parent];
+                        vector< pair<int,double> >::const_iterator pit =
+                            lower_bound(parentProbs.begin(), parentProbs.end(), pair<int,double>(word, -1));
+                        if(pit == parentProbs.end() || pit->first != word)
+                            throw runtime_error("Averaged context has a word missing from its parent");
+                        parentProb = pit->second;
+                    }
+                    myProbs[k].second = fallback*parentProb + myProbs[k].second/numSamples_;
+                    snprintf(num, sizeof(num), "%g\t", log(myProbs[k].second)/log10);
+                    out << num << context << words_[word].substr(1);
+                    // the context extended by this word, for the backoff weight
+                    int ch = findChild(0, word);
+                    for(int p = path.size()-1; ch != -1 && p >= 0; p--)
+                        ch = findChild(ch, path[p]);
+                    if(ch != -1) {
+                        snprintf(num, sizeof(num), "\t%g", log(getFallback(contexts_[ch]))/log10);
+                        out << num;
+                    }
+                    out << '\n';
+                }
+            }
+            // the level above is no longer needed
+            if(lev > 0)
+                for(unsigned j = 0; j < levels[lev-1].size(); j++)
+                    vector< pair<int,double> >().swap(probs[levels[lev-1][j]]);
+        }
+    }
+
+};
+
+}
+
+#endif
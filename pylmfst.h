@@ -19,7 +19,13 @@
 #define __PYLM_FST_
 
 #include "pylm.h"
+#include "util.h"
+#include <memory>
+#include <cfloat>
 #include <fst/fst.h>
+#include <fst/matcher.h>
+#include <fst/arc-map.h>
+#include <fst/const-fst.h>
 
 #define PHI_SYMBOL 1
 
@@ -27,15 +33,22 @@ using namespace pylm;
 
 namespace fst {
 
+template< class WordId, class CharId > class PylmMatcher;
+
 template< class WordId, class CharId >
 class PylmFst : public Fst<StdArc> {
     
 public:
 
     static const int kFileVersion = 1;
+    // states with at least this many arcs, whose labels span no more than
+    //  kIndexDensity times as many values, get a dense label index
+    static const int kMinIndexArcs = 16;
+    static const int kIndexDensity = 4;
 
     typedef typename StdArc::StateId StateId;
     typedef typename StdArc::Weight Weight;
+    typedef typename StdArc::Label Label;
 
     const PyLM<WordId> * knownLm_;
     const PyLM<CharId> * unkLm_;
@@ -43,23 +56,50 @@ public:
     const int unkVocabSize_;
     const double unkBase_;
 
-    mutable vector< vector< StdArc >* > arcs_;
+    // the arcs of a single state, which point into the arc arena
+    struct ArcRange {
+        StdArc* arcs;
+        int narcs; // -1 if the state has not been expanded yet
+        // the position of the arc for each label starting at indexBase,
+        //  or narcs if there is no such arc (only for densely labeled states)
+        int* index;
+        Label indexBase;
+        int indexSize;
+        ArcRange() : arcs(0), narcs(-1), index(0), indexBase(0), indexSize(0) { }
+    };
+
+    // the states expanded so far, which are shared by all copies of the
+    //  FST so that each state is expanded only once. Arcs are built from the
+    //  LMs as they are when first requested, so the LMs must not be changed
+    //  while the FST or any of its copies are in use
+    struct ArcCache {
+        vector< ArcRange > arcs;
+        latticelm::BumpArena< StdArc > arena;
+        latticelm::BumpArena< int > indexArena;
+        // buffers for the emission probabilities of the state being expanded
+        vector< pair<WordId,LMProb> > knownProbs;
+        vector< pair<CharId,LMProb> > unkProbs;
+        ArcCache(size_t numStates) : arcs(numStates), arena(), indexArena(), knownProbs(), unkProbs() { }
+    };
+
+    std::shared_ptr< ArcCache > cache_;
     string type_;
     uint64 properties_;
 
     PylmFst(const PyLM<WordId> & knownLm, const PyLM<CharId> & unkLm, unsigned unkVocabSize) :
         knownLm_(&knownLm), unkLm_(&unkLm), 
         unkVocabSize_(unkVocabSize), unkBase_(1.0/unkVocabSize_),
-        arcs_(knownLm.size()+unkLm.size(), 0), type_("vector"), 
+        cache_(new ArcCache(knownLm.size()+unkLm.size())), type_("vector"), 
         properties_(kOEpsilons | kILabelSorted | kOLabelSorted) {
         if(!PHI_SYMBOL) properties_ |= kIEpsilons;
     }
-    
-    ~PylmFst() {
-        for(StateId i = 0; i < (StateId)arcs_.size(); i++)
-            if(arcs_[i])
-                delete arcs_[i];
-    }
+
+    // copy an FST, sharing its expanded states unless reset is set
+    PylmFst(const PylmFst<WordId, CharId> & fst, bool reset = false) :
+        knownLm_(fst.knownLm_), unkLm_(fst.unkLm_), 
+        unkVocabSize_(fst.unkVocabSize_), unkBase_(fst.unkBase_),
+        cache_(reset ? std::shared_ptr<ArcCache>(new ArcCache(fst.cache_->arcs.size())) : fst.cache_), 
+        type_(fst.type_), properties_(fst.properties_) { }
 
     StateId Start() const {
         return max(knownLm_->getRoot().findChild(0),0);
@@ -69,86 +109,209 @@ public:
         return stateId < (StateId)knownLm_->size() ? Weight::One() : Weight::Zero();
     }
 
+    // the weight of an arc with probability prob
+    static TropicalWeight ProbWeight(double prob) {
+#ifdef LATTICELM_FAST_MATH
+        if(prob >= FLT_MIN)
+            return TropicalWeight(-latticelm::FastLog(prob));
+#endif
+        return TropicalWeight(-1*log(prob));
+    }
+
+    // the largest number of arcs that BuildArcs can create for a state
+    template <class T>
+    size_t MaxArcs(const PyLM<T> & pylm, StateId stateId, WordId vocabSize) const {
+        const PyNode<T>* myNode = pylm.getNode(stateId);
+        if(!myNode) return 0;
+        if(stateId == 0) return vocabSize;
+        size_t numTables = myNode->getTables().size();
+        return numTables > 0 ? numTables+1 : 0;
+    }
+
+    // build the arcs for a state into logs, which must have room for at
+    //  least MaxArcs() arcs, and add the number of arcs written to narcs
     template <class T>
     double BuildArcs(const PyLM<T> & pylm, double base, 
                         StateId stateId, WordId vocabSize,
-                        vector<StdArc>* logs) const {
-        typedef typename PyNode<T>::TableMap TableMap;
+                        StdArc* logs, int & narcs,
+                        vector< pair<T,LMProb> > & probs) const {
         const PyNode<T>* myNode = pylm.getNode(stateId);
         if(!myNode) return 1;
-        // expand all values for the first state only
-        const TableMap & myTables = myNode->getTables();
+        myNode->getEmitProbs(base, vocabSize, pylm.getStrengths(), pylm.getDiscounts(), probs);
         // add the actual weights
         double fallback = 1;
         if(stateId == 0) {
-            for(WordId id = 0; id < vocabSize; id++) {
-                StateId next = myNode->nextContext(id);
-                if(next == -1) next = 0;
-                double prob = myNode->getEmitProb(id,base,pylm.getStrengths(),pylm.getDiscounts());
+            for(unsigned i = 0; i < probs.size(); i++) {
+                StateId id = probs[i].first;
+                double prob = probs[i].second;
                 if(prob != 0) {
+                    StateId next = myNode->nextContext(id);
+                    if(next == -1) next = 0;
                     fallback -= prob;
-                    logs->push_back(StdArc(id+2,id+2,TropicalWeight(-1*log(prob)),next));
+                    logs[narcs++] = StdArc(id+2,id+2,ProbWeight(prob),next);
                 }
             }
-        } else if(myTables.size() > 0) {
-            logs->reserve(myTables.size()+1);
-            logs->push_back(StdArc(PHI_SYMBOL,0,TropicalWeight(0),myNode->getParent()->getPos()));
-            for(typename TableMap::const_iterator it = myTables.begin(); it != myTables.end(); it++) {
-                StateId id = it->first;
+        } else if(probs.size() > 0) {
+            StdArc & phiArc = logs[narcs++];
+            phiArc = StdArc(PHI_SYMBOL,0,TropicalWeight(0),myNode->getParent()->getPos());
+            for(unsigned i = 0; i < probs.size(); i++) {
+                StateId id = probs[i].first;
+                double prob = probs[i].second;
                 StateId next = myNode->nextContext(id);
                 if(next == -1) next = 0;
-                double prob = myNode->getEmitProb(id,base,pylm.getStrengths(),pylm.getDiscounts());
                 fallback -= prob;
-                logs->push_back(StdArc(id+2,id+2,TropicalWeight(-1*log(prob)),next));
+                logs[narcs++] = StdArc(id+2,id+2,ProbWeight(prob),next);
             }
-            (*logs)[0].weight = TropicalWeight(-1*log(fallback));
+            phiArc.weight = ProbWeight(fallback);
         }
         return fallback;
     }
 
-    const vector<StdArc> * GetArcs(StateId stateId) const {
-        if(stateId < 0 || stateId >= (StateId)arcs_.size())
-            throw runtime_error("PylmFst::GetArcs: StateId is out of bounds");
-        if(arcs_[stateId] == NULL) {
-            vector<StdArc> * logs = new vector<StdArc>;
-            double fallback = 0;
-            // known LM state
-            const StateId kSize = knownLm_->size();
-            if(stateId < kSize) {
-                // make an extra fallback to the unknown words if it's the home state
-                if(stateId == 0) {
-                    unsigned id = max(unkLm_->getRoot().findChild(0),0)+kSize;
-                    logs->push_back(StdArc(PHI_SYMBOL,0,TropicalWeight(0),id));
-                    fallback = BuildArcs(*knownLm_, 0, stateId, knownLm_->getVocabSize(), logs);
-                    (*logs)[0].weight = TropicalWeight(-1*log(fallback));
-                }
-                else
-                    BuildArcs(*knownLm_, 0, stateId, knownLm_->getVocabSize(), logs);
-                // increase the sizes appropriately
-                for(unsigned i = 0; i < logs->size(); i++) {
-                    StdArc & arc = (*logs)[i];
-                    if(arc.ilabel > 1) arc.ilabel += unkVocabSize_;
-                    if(arc.olabel > 1) arc.olabel += unkVocabSize_;
-                }
+    // the largest number of arcs that ExpandState can create for a state
+    size_t MaxStateArcs(StateId stateId) const {
+        const StateId kSize = knownLm_->size();
+        if(stateId < kSize)
+            return MaxArcs(*knownLm_, stateId, knownLm_->getVocabSize()) + (stateId == 0 ? 1 : 0);
+        return MaxArcs(*unkLm_, stateId-kSize, unkVocabSize_);
+    }
+
+    // build the arcs of a state into logs, which must have room for at least
+    //  MaxStateArcs() arcs, and return the number of arcs. This only reads
+    //  the LMs, so it can be called for different states concurrently as
+    //  long as each thread uses its own probability buffers
+    int ExpandState(StateId stateId, StdArc* logs, 
+                    vector< pair<WordId,LMProb> > & knownProbs,
+                    vector< pair<CharId,LMProb> > & unkProbs) const {
+        int narcs = 0;
+        double fallback = 0;
+        // known LM state
+        const StateId kSize = knownLm_->size();
+        if(stateId < kSize) {
+            // make an extra fallback to the unknown words if it's the home state
+            if(stateId == 0) {
+                unsigned id = max(unkLm_->getRoot().findChild(0),0)+kSize;
+                logs[narcs++] = StdArc(PHI_SYMBOL,0,TropicalWeight(0),id);
+                fallback = BuildArcs(*knownLm_, 0, stateId, knownLm_->getVocabSize(), logs, narcs, knownProbs);
+                logs[0].weight = ProbWeight(fallback);
             }
-            // unknown LM state
-            else {
-                fallback = BuildArcs(*unkLm_, unkBase_, stateId-kSize, unkVocabSize_, logs);
-                for(unsigned i = 0; i < logs->size(); i++) {
-                    StdArc & arc = (*logs)[i];
-                    // the unknown word terminal symbol returns the base state
-                    if(arc.olabel == 3) arc.nextstate = 0;
-                    // all other states are moved to the right
-                    else arc.nextstate += kSize;
-                }
+            else
+                BuildArcs(*knownLm_, 0, stateId, knownLm_->getVocabSize(), logs, narcs, knownProbs);
+            // increase the sizes appropriately
+            for(int i = 0; i < narcs; i++) {
+                StdArc & arc = logs[i];
+                if(arc.ilabel > 1) arc.ilabel += unkVocabSize_;
+                if(arc.olabel > 1) arc.olabel += unkVocabSize_;
+            }
+        }
+        // unknown LM state
+        else {
+            fallback = BuildArcs(*unkLm_, unkBase_, stateId-kSize, unkVocabSize_, logs, narcs, unkProbs);
+            for(int i = 0; i < narcs; i++) {
+                StdArc & arc = logs[i];
+                // the unknown word terminal symbol returns the base state
+                if(arc.olabel == 3) arc.nextstate = 0;
+                // all other states are moved to the right
+                else arc.nextstate += kSize;
             }
-            arcs_[stateId] = logs;
         }
-        return arcs_[stateId];
+        return narcs;
+    }
+
+    const ArcRange & GetArcs(StateId stateId) const {
+        ArcCache & cache = *cache_;
+        if(stateId < 0 || stateId >= (StateId)cache.arcs.size())
+            throw runtime_error("PylmFst::GetArcs: StateId is out of bounds");
+        ArcRange & range = cache.arcs[stateId];
+        if(range.narcs == -1) {
+            size_t maxArcs = MaxStateArcs(stateId);
+            StdArc * logs = cache.arena.Allocate(maxArcs);
+            int narcs = ExpandState(stateId, logs, cache.knownProbs, cache.unkProbs);
+            // return the space of arcs with zero probability
+            cache.arena.Shrink(maxArcs-narcs);
+            range.arcs = narcs > 0 ? logs : 0;
+            range.narcs = narcs;
+            BuildIndex(range);
+        }
+        return range;
+    }
+
+    // expand every state that is not yet in the cache on numThreads threads.
+    //  Space for all the states is reserved in a single allocation first
+    void ExpandAll(int numThreads = 1) const {
+        ArcCache & cache = *cache_;
+        const StateId numStates = cache.arcs.size();
+        vector<size_t> offsets(numStates+1, 0);
+        for(StateId s = 0; s < numStates; s++)
+            offsets[s+1] = offsets[s] + (cache.arcs[s].narcs == -1 ? MaxStateArcs(s) : 0);
+        StdArc * logs = cache.arena.Allocate(offsets[numStates]);
+        const StateId chunkSize = 256;
+        latticelm::ParallelFor((numStates+chunkSize-1)/chunkSize, numThreads, [&](int chunk) {
+            vector< pair<WordId,LMProb> > knownProbs;
+            vector< pair<CharId,LMProb> > unkProbs;
+            StateId end = min((StateId)(chunk+1)*chunkSize, numStates);
+            for(StateId s = chunk*chunkSize; s < end; s++) {
+                ArcRange & range = cache.arcs[s];
+                if(range.narcs != -1)
+                    continue;
+                int narcs = ExpandState(s, logs+offsets[s], knownProbs, unkProbs);
+                range.arcs = narcs > 0 ? logs+offsets[s] : 0;
+                range.narcs = narcs;
+            }
+        });
+        for(StateId s = 0; s < numStates; s++)
+            if(!cache.arcs[s].index)
+                BuildIndex(cache.arcs[s]);
+    }
+
+    // write the FST as an OpenFST ConstFst that can be used without the LMs,
+    //  expanding the states on numThreads threads. If delta is non-zero, the
+    //  weights are quantized to multiples of delta. The phi (fallback) arcs
+    //  are kept with input label PHI_SYMBOL
+    bool WriteConst(const string & filename, int numThreads = 1, float delta = 0) const {
+        ExpandAll(numThreads);
+        if(delta != 0) {
+            ArcMapFst< StdArc, StdArc, QuantizeMapper<StdArc> > quantFst(*this, QuantizeMapper<StdArc>(delta));
+            return ConstFst<StdArc>(quantFst).Write(filename);
+        }
+        return ConstFst<StdArc>(*this).Write(filename);
+    }
+
+    // build a direct label index for states whose arcs cover most of the
+    //  labels in their range, such as the root state
+    void BuildIndex(ArcRange & range) const {
+        if(range.narcs < kMinIndexArcs)
+            return;
+        Label first = range.arcs[0].ilabel, last = range.arcs[range.narcs-1].ilabel;
+        if(last-first >= kIndexDensity*range.narcs)
+            return;
+        range.indexBase = first;
+        range.indexSize = last-first+1;
+        range.index = cache_->indexArena.Allocate(range.indexSize);
+        fill(range.index, range.index+range.indexSize, range.narcs);
+        for(int i = range.narcs-1; i >= 0; i--)
+            range.index[range.arcs[i].ilabel-first] = i;
+    }
+
+    // find the position of the first arc in a state with the input label,
+    //  or a position whose arc has a different label if there is none
+    int FindArc(const ArcRange & range, Label label) const {
+        if(range.index) {
+            Label idx = label - range.indexBase;
+            return (idx < 0 || idx >= range.indexSize) ? range.narcs : range.index[idx];
+        }
+        int lo = 0, hi = range.narcs;
+        while(lo < hi) {
+            int mid = (lo+hi)/2;
+            if(range.arcs[mid].ilabel < label)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        return lo;
     }
 
     size_t NumArcs(StateId stateId) const {
-        return GetArcs(stateId)->size();
+        return GetArcs(stateId).narcs;
     }
 
     size_t NumInputEpsilons(StateId stateId) const {
@@ -173,7 +336,7 @@ public:
     }
 
     PylmFst<WordId, CharId>* Copy(bool reset = false) const {
-        return new PylmFst<WordId, CharId> (*knownLm_, *unkLm_, unkVocabSize_);
+        return new PylmFst<WordId, CharId> (*this, reset);
     }
 
     const fst::SymbolTable* InputSymbols() const {
@@ -188,17 +351,21 @@ public:
 
     void InitStateIterator(fst::StateIteratorData<StdArc>* data) const {
         data->base = 0;
-        data->nstates = arcs_.size();
+        data->nstates = cache_->arcs.size();
     }
 
     void InitArcIterator(StateId stateId, fst::ArcIteratorData<StdArc>* data) const {
         data->base = 0;
-        const vector<StdArc> * myArcs = GetArcs(stateId);
-        data->narcs = myArcs->size();
-        data->arcs = data->narcs > 0 ? &((*myArcs)[0]) : 0;
+        const ArcRange & myArcs = GetArcs(stateId);
+        data->narcs = myArcs.narcs;
+        data->arcs = myArcs.arcs;
         data->ref_count = 0;
     }
 
+    // input label matching uses the label index, output matching is left
+    //  to the default sorted matcher
+    MatcherBase<StdArc>* InitMatcher(MatchType matchType) const;
+
     // Write a VectorFst to a file; return false on error
     // Empty filename writes to standard output
     virtual bool Write(const string &filename) const {
@@ -214,18 +381,18 @@ public:
     bool Write(ostream &strm, const FstWriteOptions &opts) const {
         FstHeader hdr;
         hdr.SetStart(Start());
-        hdr.SetNumStates(arcs_.size());
+        hdr.SetNumStates(cache_->arcs.size());
         WriteHeader(strm, opts, kFileVersion, &hdr);
     
-        for (StateId s = 0; s < (StateId)arcs_.size(); ++s) {
+        for (StateId s = 0; s < (StateId)cache_->arcs.size(); ++s) {
             // const VectorState<A> *state = GetState(s);
             Final(s).Write(strm);
             //int64 narcs_ = state->arcs_.size();
-            const vector<StdArc> * myArcs = GetArcs(s);
-            int64 narcs_ = myArcs->size();
+            const ArcRange & myArcs = GetArcs(s);
+            int64 narcs_ = myArcs.narcs;
             WriteType(strm, narcs_);
-            for (size_t a = 0; a < myArcs->size(); ++a) {
-                const StdArc &arc = (*myArcs)[a];
+            for (int a = 0; a < myArcs.narcs; ++a) {
+                const StdArc &arc = myArcs.arcs[a];
                 WriteType(strm, arc.ilabel);
                 WriteType(strm, arc.olabel);
                 arc.weight.Write(strm);
@@ -264,6 +431,100 @@ public:
 
 };
 
+// A matcher that finds the arcs of a PylmFst state directly through its
+// label index where one exists, and by binary search otherwise. This is
+// used as the base matcher of the PhiMatcher, which handles the fallbacks.
+template< class WordId, class CharId >
+class PylmMatcher : public MatcherBase<StdArc> {
+
+public:
+
+    typedef StdArc Arc;
+    typedef typename StdArc::StateId StateId;
+    typedef typename StdArc::Weight Weight;
+    typedef typename StdArc::Label Label;
+    typedef typename PylmFst<WordId, CharId>::ArcRange ArcRange;
+
+    PylmMatcher(const PylmFst<WordId, CharId> & fst, MatchType matchType) :
+        fst_(fst.Copy()), matchType_(matchType), state_(kNoStateId), range_(0),
+        pos_(0), matchLabel_(kNoLabel), currentLoop_(false),
+        loop_(kNoLabel, 0, Weight::One(), kNoStateId) {
+        if(matchType_ != MATCH_INPUT)
+            throw runtime_error("PylmMatcher: only input matching is supported");
+    }
+
+    PylmMatcher(const PylmMatcher<WordId, CharId> & matcher, bool safe = false) :
+        fst_(matcher.fst_->Copy(safe)), matchType_(matcher.matchType_), state_(kNoStateId), 
+        range_(0), pos_(0), matchLabel_(kNoLabel), currentLoop_(false),
+        loop_(kNoLabel, 0, Weight::One(), kNoStateId) { }
+
+    ~PylmMatcher() {
+        delete fst_;
+    }
+
+    PylmMatcher<WordId, CharId>* Copy(bool safe = false) const {
+        return new PylmMatcher<WordId, CharId>(*this, safe);
+    }
+
+    MatchType Type(bool test) const { return matchType_; }
+    const Fst<StdArc> & GetFst() const { return *fst_; }
+    uint64 Properties(uint64 props) const { return props; }
+
+private:
+
+    // as with SortedMatcher, matching label 0 also returns an implicit
+    //  self-loop, and kNoLabel matches only real epsilon arcs
+    void SetState_(StateId s) {
+        if(state_ == s)
+            return;
+        state_ = s;
+        range_ = &fst_->GetArcs(s);
+        loop_.nextstate = s;
+    }
+
+    bool Find_(Label label) {
+        currentLoop_ = (label == 0);
+        matchLabel_ = (label == kNoLabel ? 0 : label);
+        pos_ = fst_->FindArc(*range_, matchLabel_);
+        bool found = pos_ < range_->narcs && range_->arcs[pos_].ilabel == matchLabel_;
+        return found || currentLoop_;
+    }
+
+    bool Done_() const {
+        if(currentLoop_)
+            return false;
+        return pos_ >= range_->narcs || range_->arcs[pos_].ilabel != matchLabel_;
+    }
+
+    const StdArc & Value_() const {
+        return currentLoop_ ? loop_ : range_->arcs[pos_];
+    }
+
+    void Next_() {
+        if(currentLoop_)
+            currentLoop_ = false;
+        else
+            pos_++;
+    }
+
+    const PylmFst<WordId, CharId> * fst_;
+    MatchType matchType_;
+    StateId state_;
+    const ArcRange * range_;
+    int pos_;
+    Label matchLabel_;
+    bool currentLoop_;
+    StdArc loop_;
+
+    void operator=(const PylmMatcher<WordId, CharId> &);
+
+};
+
+template< class WordId, class CharId >
+MatcherBase<StdArc>* PylmFst<WordId, CharId>::InitMatcher(MatchType matchType) const {
+    return matchType == MATCH_INPUT ? new PylmMatcher<WordId, CharId>(*this, matchType) : 0;
+}
+
 }
 
 #endif
@@ -23,8 +23,20 @@
 namespace latticelm {
 
 typedef int SentId;
+
+// The widths of the ids can be chosen at compile time. Wide character ids
+// are needed for alphabets of more than 32767 symbols, and narrow word ids
+// shrink the tables of the word LM when the lexicon is small
+#ifdef LATTICELM_WIDE_CHARS
+typedef int CharId;
+#else
 typedef short CharId;
+#endif
+#ifdef LATTICELM_NARROW_WORDS
+typedef short WordId;
+#else
 typedef int WordId;
+#endif
 
 class SingleSample {
     
@@ -0,0 +1,93 @@
+/*
+* Copyright 2010, Graham Neubig
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// Tests of the binary LM format, which print each failure and return the
+//  number of failed tests
+
+#include "binlm.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+using namespace pylm;
+
+static int numFailed = 0;
+
+#define CHECK(cond) do { if(!(cond)) { \
+        cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+        numFailed++; return; } } while(0)
+
+static const int kVocab = 20;
+static const char* kFileName = "test/binlmtest.bin";
+
+// random sentences over words 1..kVocab-1, where low ids are more common
+//  so that contexts are shared between sentences
+static vector< vector<int> > makeSentences(int num, unsigned seed) {
+    srand(seed);
+    vector< vector<int> > ret(num);
+    for(int i = 0; i < num; i++) {
+        int len = 1+rand()%10;
+        for(int j = 0; j < len; j++)
+            ret[i].push_back(1+(rand()%(kVocab-1))*(rand()%(kVocab-1))/(kVocab-1));
+    }
+    return ret;
+}
+
+// the mean absolute difference per word between the log10 sentence
+//  probabilities of an LM and of its binary form
+static double scoreDifference(PyLM<int> & lm, const vector<LMProb> & bases, bool quantized) {
+    vector<string> strs(kVocab);
+    for(int w = 0; w < kVocab; w++) {
+        ostringstream oss; oss << "x" << w;
+        strs[w] = oss.str();
+    }
+    BinLm::write(lm, &strs[0], &bases[0], kVocab, kFileName, quantized);
+    BinLm bin(kFileName);
+    remove(kFileName);
+    if(bin.isQuantized() != quantized || bin.findWord("3") != 3)
+        return 1;
+    vector< vector<int> > test = makeSentences(100, 2);
+    double diff = 0;
+    int words = 0;
+    for(unsigned i = 0; i < test.size(); i++) {
+        vector<unsigned> sent(test[i].begin(), test[i].end());
+        LMProb prob = lm.calcSentence(test[i], bases, false)/log(10.0);
+        diff += fabs(bin.getSentenceLogProb(&sent[0], sent.size())-prob);
+        words += sent.size();
+    }
+    return diff/words;
+}
+
+// unquantized scores must match the LM up to float precision, and
+//  quantized ones must stay close to it
+static void testScores() {
+    vector<LMProb> bases(kVocab, 1.0/kVocab);
+    PyLM<int> lm(3);
+    vector< vector<int> > sents = makeSentences(300, 1);
+    for(unsigned i = 0; i < sents.size(); i++)
+        lm.calcSentence(sents[i], bases, true);
+    CHECK(scoreDifference(lm, bases, false) < 1e-5);
+    CHECK(scoreDifference(lm, bases, true) < 0.01);
+}
+
+int main() {
+    testScores();
+    if(numFailed)
+        cerr << numFailed << " tests failed" << endl;
+    else
+        cerr << "All tests passed" << endl;
+    return numFailed;
+}
@@ -0,0 +1,310 @@
+/*
+* Copyright 2010, Graham Neubig
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// Tests of the Pitman-Yor LM, which print each failure and return the
+//  number of failed tests
+
+#include "pylm.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+using namespace pylm;
+
+static int numFailed = 0;
+
+#define CHECK(cond) do { if(!(cond)) { \
+        cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+        numFailed++; return; } } while(0)
+
+static const int kVocab = 20;
+
+// random sentences over words 1..kVocab-1, where low ids are more common
+//  so that contexts are shared between sentences
+static vector< vector<int> > makeSentences(int num, unsigned seed) {
+    srand(seed);
+    vector< vector<int> > ret(num);
+    for(int i = 0; i < num; i++) {
+        int len = 1+rand()%10;
+        for(int j = 0; j < len; j++)
+            ret[i].push_back(1+(rand()%(kVocab-1))*(rand()%(kVocab-1))/(kVocab-1));
+    }
+    return ret;
+}
+
+static void addSentences(PyLM<int> & lm, const vector< vector<int> > & sents, const vector<LMProb> & bases) {
+    for(unsigned i = 0; i < sents.size(); i++)
+        lm.calcSentence(sents[i], bases, true);
+}
+
+// the longest existing context of the words, most recent first, found by
+//  walking down from the root
+static PyId walkDown(const PyLM<int> & lm, const vector<int> & words) {
+    PyId node = 0;
+    for(int j = 0; j < (int)words.size() && j < lm.getN()-1; j++) {
+        PyId next = lm.getNode(node)->findChild(words[j]);
+        if(next == -1) break;
+        node = next;
+    }
+    return node;
+}
+
+// whether the successor of every context is the longest context of the
+//  word and the context's words
+static bool successorsMatch(const PyLM<int> & lm) {
+    for(unsigned i = 0; i < lm.size(); i++) {
+        const PyNode<int>* node = lm.getNode(i);
+        if(!node) continue;
+        for(int w = 0; w < kVocab; w++) {
+            // the context's words from the top of the tree down are the
+            //  previous words, most recent first
+            vector<int> words;
+            for(PyId ctx = i; ctx > 0; ctx = lm.getNode(ctx)->getParentPos())
+                words.push_back(lm.getNode(ctx)->getId());
+            words.push_back(w);
+            reverse(words.begin(), words.end());
+            if(node->nextContext(w) != walkDown(lm, words))
+                return false;
+        }
+    }
+    return true;
+}
+
+// successors must not depend on whether their links are cached
+static void testNextContext() {
+    vector<LMProb> bases(kVocab, 1.0/kVocab);
+    PyLM<int> lm(3);
+    addSentences(lm, makeSentences(300, 1), bases);
+    CHECK(successorsMatch(lm));
+}
+
+// scoring without adding must not change the model
+static void testReadOnlyScoring() {
+    vector<LMProb> bases(kVocab, 1.0/kVocab);
+    PyLM<int> lm(3);
+    addSentences(lm, makeSentences(200, 2), bases);
+    const size_t bytes = lm.getMemoryBytes();
+    const unsigned long version = lm.getVersion();
+    vector< vector<int> > test = makeSentences(100, 3);
+    vector<LMProb> first;
+    for(unsigned i = 0; i < test.size(); i++)
+        first.push_back(lm.calcSentence(test[i], bases, false));
+    for(unsigned i = 0; i < test.size(); i++)
+        CHECK(lm.calcSentence(test[i], bases, false) == first[i]);
+    CHECK(lm.getMemoryBytes() == bytes);
+    CHECK(lm.getVersion() == version);
+}
+
+// a saved and reloaded model must give the same probabilities and
+//  successors as the original
+static void testReadWrite() {
+    vector<LMProb> bases(kVocab, 1.0/kVocab);
+    PyLM<int> lm(3);
+    vector< vector<int> > sents = makeSentences(300, 4);
+    addSentences(lm, sents, bases);
+    std::mt19937 rng(1);
+    lm.sampleParameters(rng);
+    stringstream ss;
+    lm.write(ss);
+    PyLM<int>* read = PyLM<int>::read(ss);
+    CHECK(read->size() == lm.size());
+    vector< vector<int> > test = makeSentences(100, 5);
+    for(unsigned i = 0; i < test.size(); i++)
+        CHECK(read->calcSentence(test[i], bases, false) == lm.calcSentence(test[i], bases, false));
+    for(unsigned i = 0; i < lm.size(); i++)
+        for(int w = 0; w < kVocab; w++)
+            CHECK(read->getNode(i)->nextContext(w) == lm.getNode(i)->nextContext(w));
+    // the reloaded links must be dropped with their contexts
+    for(unsigned i = 0; i < sents.size(); i++)
+        read->removeCustomers(sents[i]);
+    CHECK(read->getRoot().getCustomerCount() == 0);
+    addSentences(*read, makeSentences(300, 6), bases);
+    CHECK(successorsMatch(*read));
+    delete read;
+}
+
+static int countContexts(const PyLM<int> & lm) {
+    int ret = 0;
+    for(unsigned i = 0; i < lm.size(); i++)
+        if(lm.getNode(i)) ret++;
+    return ret;
+}
+
+// the number of positions of the sentences whose whole context exists
+static int countFullContexts(const PyLM<int> & lm, const vector< vector<int> > & sents) {
+    int ret = 0;
+    for(unsigned i = 0; i < sents.size(); i++) {
+        for(int j = 0; j < (int)sents[i].size(); j++) {
+            vector<int> words(sents[i].rend()-j, sents[i].rend());
+            words.push_back(0);
+            if(lm.getNode(walkDown(lm, words))->getLevel() == min(j+1, lm.getN()-1))
+                ret++;
+        }
+    }
+    return ret;
+}
+
+// a pruned model must keep removing the customers of the pruned contexts
+//  from where they were merged, both while its contexts are frozen and
+//  after they are thawed and grow their children again
+static void testPrune(int n) {
+    vector<LMProb> bases(kVocab, 1.0/kVocab);
+    PyLM<int> lm(n);
+    vector< vector<int> > sents = makeSentences(300, 7), other = makeSentences(300, 8);
+    addSentences(lm, sents, bases);
+    const int full = countContexts(lm);
+    const size_t maxBytes = lm.getMemoryBytes()*2/3;
+    CHECK(lm.prune(maxBytes, maxBytes/2) > 0);
+    CHECK(lm.checkConsistency(bases));
+    // resample while over the budget, with some sentences changing
+    for(int iter = 0; iter < 5; iter++) {
+        for(unsigned i = 0; i < sents.size(); i++) {
+            if(i%3 == 0) {
+                lm.replaceSentence(sents[i], other[i], bases);
+                swap(sents[i], other[i]);
+            } else {
+                lm.removeCustomers(sents[i]);
+                lm.calcSentence(sents[i], bases, true);
+            }
+        }
+        lm.prune(maxBytes, maxBytes/2);
+        CHECK(lm.checkConsistency(bases));
+    }
+    // the orphans must be saved with the model
+    stringstream ss;
+    lm.write(ss);
+    PyLM<int>* read = PyLM<int>::read(ss);
+    for(unsigned i = 0; i < sents.size(); i++)
+        read->removeCustomers(sents[i]);
+    CHECK(read->getRoot().getCustomerCount() == 0);
+    delete read;
+    int positions = 0;
+    for(unsigned i = 0; i < sents.size(); i++)
+        positions += sents[i].size();
+    CHECK(countFullContexts(lm, sents) < positions);
+    // within the budget but above the thawing size nothing changes
+    CHECK(lm.prune(full*1024*1024, 0) == 0);
+    for(unsigned i = 0; i < sents.size(); i++) {
+        lm.removeCustomers(sents[i]);
+        lm.calcSentence(sents[i], bases, true);
+    }
+    CHECK(countFullContexts(lm, sents) < positions);
+    // below the thawing size the pruned contexts grow again, so once every
+    //  sentence has been resampled all their contexts exist
+    CHECK(lm.prune(full*1024*1024, full*1024*1024) == 0);
+    for(unsigned i = 0; i < sents.size(); i++) {
+        lm.removeCustomers(sents[i]);
+        lm.calcSentence(sents[i], bases, true);
+    }
+    CHECK(countFullContexts(lm, sents) == positions);
+    CHECK(lm.checkConsistency(bases));
+    CHECK(successorsMatch(lm));
+    for(unsigned i = 0; i < sents.size(); i++)
+        lm.removeCustomers(sents[i]);
+    CHECK(lm.getRoot().getCustomerCount() == 0);
+}
+
+// a two-character spelling of each word for a unigram spelling model,
+//  where every root table of the word model has one spelling seated
+static vector<int> spell(int word) {
+    vector<int> ret;
+    ret.push_back(1+word%5);
+    ret.push_back(1+word/5);
+    return ret;
+}
+
+static vector<LMProb> spellingBases(PyLM<int> & unk, const vector<int> & words, const vector<LMProb> & charBases) {
+    vector<LMProb> ret(words.size());
+    for(unsigned j = 0; j < words.size(); j++)
+        ret[j] = exp(unk.calcSentence(spell(words[j]), charBases, false));
+    return ret;
+}
+
+// delta updates in two halves, with the removed spellings taken out of the
+//  spelling model before the bases of the new words are found, must keep
+//  one spelling for every root table of the word model
+static void testDeltaUpdate() {
+    vector<LMProb> charBases(kVocab, 1.0/kVocab);
+    PyLM<int> known(3), unk(1);
+    vector< vector<int> > sents = makeSentences(200, 9), other = makeSentences(200, 10);
+    for(unsigned i = 0; i < sents.size(); i++) {
+        known.calcSentence(sents[i], spellingBases(unk, sents[i], charBases), true);
+        const vector<int> & addPositions = known.getBasePositions();
+        for(unsigned j = 0; j < addPositions.size(); j++)
+            unk.calcSentence(spell(sents[i][addPositions[j]]), charBases, true);
+    }
+    for(int iter = 0; iter < 3; iter++) {
+        for(unsigned i = 0; i < sents.size(); i++) {
+            // keep a prefix of the old sentence so some n-grams are shared
+            vector<int> words(sents[i].begin(), sents[i].begin()+sents[i].size()/2);
+            words.insert(words.end(), other[i].begin(), other[i].end());
+            vector<bool> kept = known.removeChangedCustomers(sents[i], words);
+            const vector<int> & remPositions = known.getRemovedBasePositions();
+            for(unsigned j = 0; j < remPositions.size(); j++)
+                unk.removeCustomers(spell(sents[i][remPositions[j]]));
+            CHECK(unk.getRoot().getCustomerCount() == 2*known.getRoot().getTableCount());
+            known.addChangedCustomers(words, spellingBases(unk, words, charBases), kept);
+            const vector<int> & addPositions = known.getBasePositions();
+            for(unsigned j = 0; j < addPositions.size(); j++)
+                unk.calcSentence(spell(words[addPositions[j]]), charBases, true);
+            CHECK(unk.getRoot().getCustomerCount() == 2*known.getRoot().getTableCount());
+            sents[i] = words;
+        }
+        CHECK(known.checkConsistency(vector<LMProb>(kVocab, 1.0/kVocab)));
+    }
+    for(unsigned i = 0; i < sents.size(); i++) {
+        known.removeCustomers(sents[i]);
+        const vector<int> & remPositions = known.getBasePositions();
+        for(unsigned j = 0; j < remPositions.size(); j++)
+            unk.removeCustomers(spell(sents[i][remPositions[j]]));
+    }
+    CHECK(known.getRoot().getCustomerCount() == 0);
+    CHECK(unk.getRoot().getCustomerCount() == 0);
+}
+
+// parameter samples must depend only on the seeds, not on what was
+//  sampled before
+static void testSampleParameters() {
+    vector<LMProb> bases(kVocab, 1.0/kVocab);
+    PyLM<int> lm(3);
+    addSentences(lm, makeSentences(300, 11), bases);
+    vector<LMProb> discs[2], strens[2];
+    for(int k = 0; k < 2; k++) {
+        PyLM<int> copy(lm);
+        std::mt19937 rng(5);
+        srand(5);
+        copy.sampleParameters(rng);
+        discs[k] = copy.getDiscounts();
+        strens[k] = copy.getStrengths();
+    }
+    CHECK(discs[0] == discs[1]);
+    CHECK(strens[0] == strens[1]);
+}
+
+int main() {
+    testNextContext();
+    testReadOnlyScoring();
+    testReadWrite();
+    testPrune(2);
+    testPrune(4);
+    testDeltaUpdate();
+    testSampleParameters();
+    if(numFailed)
+        cerr << numFailed << " tests failed" << endl;
+    else
+        cerr << "All tests passed" << endl;
+    return numFailed;
+}
@@ -2,6 +2,19 @@
 #define LATTICELM_UTIL_H__
 
 #include <vector>
+#include <algorithm>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <cstring>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #define LATTICELM_SAFE
 
@@ -34,6 +47,231 @@ inline T & SafeAccess(std::vector<T> & vec, int idx) {
     return vec[idx];
 }
 
+// Write a plain value or a vector of plain values in binary
+template < class T >
+inline void WriteBinary(std::ostream & out, const T & val) {
+    out.write((const char*)&val, sizeof(T));
+}
+template < class T >
+inline void WriteBinary(std::ostream & out, const std::vector<T> & vec) {
+    WriteBinary(out, (uint32_t)vec.size());
+    if(vec.size())
+        out.write((const char*)&vec[0], vec.size()*sizeof(T));
+}
+
+// Read a value written by WriteBinary, throwing at the end of the stream
+template < class T >
+inline void ReadBinary(std::istream & in, T & val) {
+    if(!in.read((char*)&val, sizeof(T)))
+        THROW_ERROR("Unexpected end of binary input");
+}
+template < class T >
+inline void ReadBinary(std::istream & in, std::vector<T> & vec) {
+    uint32_t size;
+    ReadBinary(in, size);
+    vec.resize(size);
+    if(size && !in.read((char*)&vec[0], size*sizeof(T)))
+        THROW_ERROR("Unexpected end of binary input");
+}
+
+// Approximate natural logarithm of a positive normal float, accurate to
+// within about two units in the last place of the result. It has no table
+// lookups or data-dependent branches, so loops over it can be vectorized.
+inline float FastLog(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int e = (int)((bits >> 23) & 255) - 127;
+    bits = (bits & 0x7FFFFF) | 0x3F800000;
+    float m;
+    memcpy(&m, &bits, sizeof(m));
+    // take the mantissa to [sqrt(1/2),sqrt(2)) so the series below is short
+    int big = m > 1.41421356f;
+    m = big ? m*0.5f : m;
+    e += big;
+    // log(m) = 2 atanh((m-1)/(m+1))
+    float t = (m-1)/(m+1), t2 = t*t;
+    return e*0.693147181f + 2*t*(1 + t2*(1.f/3 + t2*(1.f/5 + t2*(1.f/7))));
+}
+
+// Call func(i) for every i in [0,n) using numThreads threads. Items are
+// handed out one at a time in order, so func must be safe to call
+// concurrently for different items. The first exception thrown by any
+// call is rethrown once all the threads have finished.
+template < class Func >
+void ParallelFor(int n, int numThreads, Func func) {
+    if(numThreads <= 1 || n <= 1) {
+        for(int i = 0; i < n; i++)
+            func(i);
+        return;
+    }
+    std::atomic<int> next(0);
+    std::exception_ptr error;
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < std::min(numThreads, n); t++) {
+        threads.push_back(std::thread([&]() {
+            for(int i = next++; i < n && !failed; i = next++) {
+                try {
+                    func(i);
+                } catch(...) {
+                    if(!failed.exchange(true))
+                        error = std::current_exception();
+                }
+            }
+        }));
+    }
+    for(unsigned t = 0; t < threads.size(); t++)
+        threads[t].join();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+// A bump allocator that carves contiguous arrays out of large blocks.
+// Arrays cannot be freed individually, everything is released at once
+// when the arena is cleared or destroyed.
+template < class T >
+class BumpArena {
+
+public:
+
+    BumpArena(size_t blockSize = 4096) : blocks_(), blockSize_(blockSize), used_(0), capacity_(0) { }
+    ~BumpArena() { Clear(); }
+
+    // allocate n contiguous elements
+    T* Allocate(size_t n) {
+        if(n == 0)
+            return 0;
+        if(used_ + n > capacity_) {
+            capacity_ = std::max(n, blockSize_);
+            blocks_.push_back(new T[capacity_]);
+            used_ = 0;
+        }
+        T* ret = blocks_.back() + used_;
+        used_ += n;
+        return ret;
+    }
+
+    // return the last n elements of the most recent allocation to the arena
+    void Shrink(size_t n) {
+#ifdef LATTICELM_SAFE
+        if(n > used_)
+            THROW_ERROR("Shrinking the arena by "<<n<<" with only "<<used_<<" used");
+#endif
+        used_ -= n;
+    }
+
+    void Clear() {
+        for(unsigned i = 0; i < blocks_.size(); i++)
+            delete [] blocks_[i];
+        blocks_.clear();
+        used_ = capacity_ = 0;
+    }
+
+private:
+
+    std::vector<T*> blocks_;
+    size_t blockSize_, used_, capacity_;
+
+    BumpArena(const BumpArena &);
+    BumpArena & operator=(const BumpArena &);
+
+};
+
+// Run jobs in order on a background thread, with at most maxQueued jobs
+// waiting to start. push() blocks while the queue is full, and with a
+// maxQueued of 0 jobs are run by push() itself. The first exception thrown
+// by a job is rethrown by the next push() or by finish().
+class BackgroundQueue {
+
+public:
+
+    BackgroundQueue(int maxQueued = 1) : maxQueued_(maxQueued), done_(false) { }
+    ~BackgroundQueue() {
+        stop();
+    }
+
+    void setMaxQueued(int maxQueued) { maxQueued_ = maxQueued; }
+
+    void push(const std::function<void()> & job) {
+        rethrow();
+        if(maxQueued_ <= 0) {
+            job();
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        if(!thread_.joinable())
+            thread_ = std::thread(&BackgroundQueue::run, this);
+        while((int)jobs_.size() >= maxQueued_)
+            changed_.wait(lock);
+        jobs_.push_back(job);
+        changed_.notify_all();
+    }
+
+    // wait for all the jobs to finish
+    void finish() {
+        stop();
+        rethrow();
+    }
+
+private:
+
+    int maxQueued_;
+    bool done_;
+    std::deque< std::function<void()> > jobs_;
+    std::exception_ptr error_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::thread thread_;
+
+    BackgroundQueue(const BackgroundQueue &);
+    BackgroundQueue & operator=(const BackgroundQueue &);
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true) {
+            while(jobs_.empty() && !done_)
+                changed_.wait(lock);
+            if(jobs_.empty())
+                return;
+            std::function<void()> job = jobs_.front();
+            jobs_.pop_front();
+            changed_.notify_all();
+            lock.unlock();
+            try {
+                job();
+            } catch(...) {
+                lock.lock();
+                if(!error_)
+                    error_ = std::current_exception();
+                lock.unlock();
+            }
+            lock.lock();
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+            changed_.notify_all();
+        }
+        if(thread_.joinable())
+            thread_.join();
+        done_ = false;
+    }
+
+    void rethrow() {
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            error.swap(error_);
+        }
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+};
+
 }
 
 #endif